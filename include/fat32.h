@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+// On-disk FAT32 layout shared by filesys and mkimage
+
+// File attributes
+#define ATTR_READ_ONLY   0x01
+#define ATTR_HIDDEN      0x02
+#define ATTR_SYSTEM      0x04
+#define ATTR_VOLUME_ID   0x08
+#define ATTR_DIRECTORY   0x10
+#define ATTR_ARCHIVE     0x20
+
+// FAT entry values
+#define FAT_ENTRY_MASK   0x0FFFFFFF
+#define FAT_EOC          0x0FFFFFFF   // end of chain as written by both tools
+#define FAT_EOC_MIN      0x0FFFFFF8   // anything from here up ends a chain
+
+// FSInfo sector fields
+#define FSI_LEAD_SIG     0x41615252
+#define FSI_STRUC_SIG    0x61417272
+#define FSI_TRAIL_SIG    0xAA550000
+#define FSI_UNKNOWN      0xFFFFFFFF
+
+// structure for FAT32 Image
+struct imageStruct {
+    int fd;
+    uint16_t BpSect;
+    uint8_t sectpClus;
+    uint8_t numFATs;
+    uint16_t rsvSecCnt;
+    uint32_t secpFAT;
+    uint32_t rootClus;
+    uint32_t totalSec;
+    uint32_t totalDataClus;
+    uint32_t maxClus;
+    uint32_t entpFAT;
+    uint16_t fsInfoSec;
+    uint16_t fsInfoBackupSec;   // copy of FSInfo behind the backup boot sector, 0 if none
+    uint32_t dataStartOffset;
+    int64_t size;
+};
+
+// structure for directories
+typedef struct __attribute__((packed)) directoryEntry {
+    char DIR_Name[11];
+    uint8_t DIR_Attr;
+    char padding_1[8]; //unused fields
+    uint16_t DIR_FstClusHI;
+    char padding_2[4]; //unused fields
+    uint16_t DIR_FstClusLO;
+    uint32_t DIR_FileSize;
+} directoryEntry;
@@ -8,7 +8,6 @@ typedef struct {
     size_t size;
 } tokenlist;
 
-char * get_input(void);
 tokenlist * get_tokens(char *input);
 tokenlist * new_tokenlist(void);
 void add_token(tokenlist *tokens, char *item);
@@ -0,0 +1,533 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+// Benchmark driver for filesys:
+//   ./bin/bench [--scale <n>] [--only <scenario>] [--filesys-arg <arg>]... [-o <json file>]
+// Every scenario builds a fresh image with mkimage and runs its commands through
+// filesys --batch with stdout discarded. Latency histograms and the image I/O of
+// the backend come from the --stats-json file filesys writes on exit, minus a run
+// of the same image with only the setup commands.
+
+#define MAX_FILESYS_ARGS   16
+#define MAX_TOOL_ARGS      32
+#define STAT_NAME_SIZE     16
+#define MAX_COMMANDS       32
+#define MAX_IO_KINDS       16
+#define LATENCY_BUCKETS    32
+
+// One command's counters from the stats file
+typedef struct {
+    char name[STAT_NAME_SIZE];
+    uint64_t count, errors, totalNs, syscalls;
+    uint64_t buckets[LATENCY_BUCKETS];   // bucket b holds latencies below 2^b us
+} benchCommand;
+
+// One backend I/O primitive from the stats file
+typedef struct {
+    char name[STAT_NAME_SIZE];
+    uint64_t calls, bytes;
+} benchIO;
+
+typedef struct {
+    benchCommand commands[MAX_COMMANDS];
+    int numCommands;
+    benchIO io[MAX_IO_KINDS];
+    int numIO;
+    double wallSeconds;
+    int exitStatus;
+} benchRun;
+
+typedef struct {
+    const char *name;
+    const char *mkimageArgs;
+    void (*setup)(FILE *script);
+    void (*measure)(FILE *script);
+} benchScenario;
+
+const char *filesysPath = "bin/filesys";
+const char *mkimagePath = "bin/mkimage";
+const char *filesysArgs[MAX_FILESYS_ARGS];
+int numFilesysArgs = 0;
+int scale = 1;
+char workDir[64];
+uint64_t rngState = 42;
+
+uint64_t nextRandom() {
+    // xorshift64*, the scripts are the same on every run
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return rngState * 0x2545F4914F6CDD1DULL;
+}
+
+double nowSeconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void writePayload(FILE *script, int length) {
+    // write arguments are single tokens, so the payload has no spaces
+    for (int i = 0; i < length; i++) {
+        fputc('a' + i % 26, script);
+    }
+}
+
+// scenario scripts, setup commands run before the measured ones and are not reported
+
+void measureLargeLs(FILE *script) {
+    for (int i = 0; i < 10 * scale; i++) {
+        fprintf(script, "ls\n");
+    }
+}
+
+void measureDeepPaths(FILE *script) {
+    char path[256] = "";
+    for (int level = 0; level < 10; level++) {
+        sprintf(path + strlen(path), "%sD%07d", level > 0 ? "/" : "", level % 2);
+    }
+    for (int i = 0; i < 200 * scale; i++) {
+        fprintf(script, "ls %s\n", path);
+    }
+    for (int i = 0; i < 20 * scale; i++) {
+        for (int level = 0; level < 10; level++) {
+            fprintf(script, "cd D%07d\n", level % 2);
+        }
+        for (int level = 0; level < 10; level++) {
+            fprintf(script, "cd ..\n");
+        }
+    }
+}
+
+void measureCreatStorm(FILE *script) {
+    for (int i = 0; i < 2000 * scale; i++) {
+        fprintf(script, "creat C%07d\n", i);
+    }
+}
+
+void measureMkdirStorm(FILE *script) {
+    for (int i = 0; i < 500 * scale; i++) {
+        fprintf(script, "mkdir M%07d\n", i);
+    }
+}
+
+void setupOpenForRead(FILE *script) {
+    fprintf(script, "open F0000000 -r\n");
+}
+
+void measureSequentialRead(FILE *script, int size) {
+    for (int pass = 0; pass < scale; pass++) {
+        fprintf(script, "lseek F0000000 0\n");
+        for (int i = 0; i < 8 * 1024 * 1024 / size; i++) {
+            fprintf(script, "read F0000000 %d\n", size);
+        }
+    }
+}
+
+void measureSequentialRead4k(FILE *script) {
+    measureSequentialRead(script, 4096);
+}
+
+void measureSequentialRead64k(FILE *script) {
+    measureSequentialRead(script, 65536);
+}
+
+void measureRandomRead4k(FILE *script) {
+    for (int i = 0; i < 500 * scale; i++) {
+        fprintf(script, "lseek F0000000 %d\n", (int)(nextRandom() % 2048) * 4096);
+        fprintf(script, "read F0000000 4096\n");
+    }
+}
+
+void setupWriteFile(FILE *script) {
+    fprintf(script, "creat W\nopen W -rw\n");
+}
+
+void measureSequentialWrite1k(FILE *script) {
+    for (int i = 0; i < 2000 * scale; i++) {
+        fprintf(script, "write W ");
+        writePayload(script, 1024);
+        fprintf(script, "\n");
+    }
+}
+
+void setupRandomWrite(FILE *script) {
+    // a 1 MB file to seek around in
+    setupWriteFile(script);
+    for (int i = 0; i < 1024; i++) {
+        fprintf(script, "write W ");
+        writePayload(script, 1024);
+        fprintf(script, "\n");
+    }
+}
+
+void measureRandomWrite1k(FILE *script) {
+    for (int i = 0; i < 500 * scale; i++) {
+        fprintf(script, "lseek W %d\n", (int)(nextRandom() % 1023) * 1024);
+        fprintf(script, "write W ");
+        writePayload(script, 1024);
+        fprintf(script, "\n");
+    }
+}
+
+void measureRemoveChains(FILE *script) {
+    for (int i = 0; i < 64; i++) {
+        fprintf(script, "rm F%07d\n", i);
+    }
+}
+
+void measureAllocNearFull(FILE *script) {
+    for (int i = 0; i < 60 * scale; i++) {
+        fprintf(script, "creat A%07d\n", i);
+        fprintf(script, "fallocate A%07d 32768\n", i);
+    }
+}
+
+benchScenario scenarios[] = {
+    { "ls_large_dir", "--size-mb 256 --depth 0 --files 20000 --file-size 0", NULL, measureLargeLs },
+    { "path_resolution", "--size-mb 256 --fanout 2 --depth 10 --files 4 --file-size 0", NULL, measureDeepPaths },
+    { "creat_storm", "--size-mb 256 --depth 0 --files 0", NULL, measureCreatStorm },
+    { "mkdir_storm", "--size-mb 256 --depth 0 --files 0", NULL, measureMkdirStorm },
+    { "seq_read_4k", "--size-mb 64 --depth 0 --files 1 --file-size 8388608 --fill", setupOpenForRead, measureSequentialRead4k },
+    { "seq_read_64k", "--size-mb 64 --depth 0 --files 1 --file-size 8388608 --fill", setupOpenForRead, measureSequentialRead64k },
+    { "rand_read_4k", "--size-mb 64 --depth 0 --files 1 --file-size 8388608 --fill --fragmentation 10", setupOpenForRead, measureRandomRead4k },
+    { "seq_write_1k", "--size-mb 256 --depth 0 --files 0", setupWriteFile, measureSequentialWrite1k },
+    { "rand_write_1k", "--size-mb 256 --depth 0 --files 0", setupRandomWrite, measureRandomWrite1k },
+    { "rm_long_chains", "--size-mb 512 --cluster-size 512 --depth 0 --files 64 --file-size 4194304", NULL, measureRemoveChains },
+    { "alloc_near_full", "--size-mb 64 --cluster-size 512 --depth 0 --files 50 --file-size 1000000 --fragmentation 2", NULL, measureAllocNearFull },
+};
+
+bool runMkimage(const benchScenario *scenario, const char *imagePath) {
+    // Builds the scenario image, mkimage output is not part of the report
+    char args[256];
+    char *argv[MAX_TOOL_ARGS];
+    int argc = 0;
+    snprintf(args, sizeof(args), "%s", scenario->mkimageArgs);
+    argv[argc++] = (char *)mkimagePath;
+    char *save;
+    for (char *tok = strtok_r(args, " ", &save); tok != NULL && argc < MAX_TOOL_ARGS - 2; tok = strtok_r(NULL, " ", &save)) {
+        argv[argc++] = tok;
+    }
+    argv[argc++] = (char *)imagePath;
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        execv(mkimagePath, argv);
+        _exit(127);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Error: mkimage failed for %s\n", scenario->name);
+        return false;
+    }
+    return true;
+}
+
+bool readStatsJSON(const char *path, benchRun *run) {
+    // Picks the io and commands sections out of a filesys --stats-json file
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror("Error reading filesys stats");
+        return false;
+    }
+    char *text = NULL;
+    size_t capacity = 0;
+    ssize_t length = getdelim(&text, &capacity, '\0', in);
+    fclose(in);
+    if (length <= 0) {
+        free(text);
+        return false;
+    }
+
+    char *pos = strstr(text, "\"io\": {");
+    int used;
+    if (pos != NULL) {
+        pos += strlen("\"io\": {");
+        benchIO *io = &run->io[0];
+        while (run->numIO < MAX_IO_KINDS &&
+               sscanf(pos, " \"%15[^\"]\": {\"calls\": %" SCNu64 ", \"bytes\": %" SCNu64 "}%n",
+                      io->name, &io->calls, &io->bytes, &used) == 3) {
+            pos += used;
+            pos += (*pos == ',');
+            io = &run->io[++run->numIO];
+        }
+    }
+    pos = strstr(text, "\"commands\": {");
+    if (pos != NULL) {
+        pos += strlen("\"commands\": {");
+        benchCommand *command = &run->commands[0];
+        uint64_t maxNs, maxSyscalls;
+        while (run->numCommands < MAX_COMMANDS &&
+               sscanf(pos, " \"%15[^\"]\": {\"count\": %" SCNu64 ", \"errors\": %" SCNu64 ", \"total_ns\": %" SCNu64
+                      ", \"max_ns\": %" SCNu64 ", \"syscalls\": %" SCNu64 ", \"max_syscalls\": %" SCNu64 ", \"histogram_us\": [%n",
+                      command->name, &command->count, &command->errors, &command->totalNs, &maxNs,
+                      &command->syscalls, &maxSyscalls, &used) == 7) {
+            pos += used;
+            for (int b = 0; b < LATENCY_BUCKETS && sscanf(pos, " %" SCNu64 "%n", &command->buckets[b], &used) == 1; b++) {
+                pos += used;
+                pos += (*pos == ',');
+            }
+            pos = strchr(pos, '}');
+            if (pos == NULL) {
+                break;
+            }
+            pos++;
+            pos += (*pos == ',');
+            command = &run->commands[++run->numCommands];
+        }
+    }
+    free(text);
+    return true;
+}
+
+bool runFilesys(const char *scriptPath, const char *imagePath, benchRun *run) {
+    // Runs one batch script with stdout discarded and loads the stats it writes on exit
+    memset(run, 0, sizeof(benchRun));
+    char statsPath[160];
+    snprintf(statsPath, sizeof(statsPath), "%s.stats.json", scriptPath);
+    const char *argv[MAX_FILESYS_ARGS + 8];
+    int argc = 0;
+    argv[argc++] = filesysPath;
+    for (int i = 0; i < numFilesysArgs; i++) {
+        argv[argc++] = filesysArgs[i];
+    }
+    argv[argc++] = "--keep-going";
+    argv[argc++] = "--stats-json";
+    argv[argc++] = statsPath;
+    argv[argc++] = "--batch";
+    argv[argc++] = scriptPath;
+    argv[argc++] = imagePath;
+    argv[argc] = NULL;
+
+    double start = nowSeconds();
+    pid_t pid = fork();
+    if (pid == 0) {
+        // what the commands print is not image I/O
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        execv(filesysPath, (char *const *)argv);
+        _exit(127);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+        return false;
+    }
+    run->wallSeconds = nowSeconds() - start;
+    run->exitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    bool ok = readStatsJSON(statsPath, run);
+    unlink(statsPath);
+    return ok;
+}
+
+benchCommand *findCommand(benchRun *run, const char *name) {
+    for (int i = 0; i < run->numCommands; i++) {
+        if (strcmp(run->commands[i].name, name) == 0) {
+            return &run->commands[i];
+        }
+    }
+    return NULL;
+}
+
+void subtractBaseline(benchRun *measured, benchRun *baseline) {
+    // Leaves only what the measured commands added on top of the setup
+    for (int i = 0; i < measured->numCommands; i++) {
+        benchCommand *command = &measured->commands[i];
+        benchCommand *setup = findCommand(baseline, command->name);
+        if (setup == NULL) {
+            continue;
+        }
+        command->count -= setup->count;
+        command->errors -= setup->errors;
+        command->totalNs -= setup->totalNs;
+        command->syscalls -= setup->syscalls;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            command->buckets[b] -= setup->buckets[b];
+        }
+    }
+    for (int i = 0; i < measured->numIO; i++) {
+        for (int j = 0; j < baseline->numIO; j++) {
+            if (strcmp(measured->io[i].name, baseline->io[j].name) == 0) {
+                measured->io[i].calls -= baseline->io[j].calls;
+                measured->io[i].bytes -= baseline->io[j].bytes;
+            }
+        }
+    }
+}
+
+uint64_t percentileUs(benchCommand *command, double q) {
+    // Upper bound of the histogram bucket holding the q quantile, like filesys stats
+    uint64_t target = (uint64_t)(q * command->count + 0.999999);
+    uint64_t seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += command->buckets[b];
+        if (seen >= target && seen > 0) {
+            return 1ULL << b;
+        }
+    }
+    return 0;
+}
+
+void printLatency(FILE *json, benchCommand *command) {
+    // ops, errors, ops/sec over the command time and p50/p99 bucket bounds
+    double seconds = command->totalNs / 1e9;
+    fprintf(json, "\"ops\": %" PRIu64 ", \"errors\": %" PRIu64 ", \"ops_per_sec\": %.1f, "
+            "\"p50_us\": %" PRIu64 ", \"p99_us\": %" PRIu64 ", \"syscalls\": %" PRIu64,
+            command->count, command->errors, seconds > 0 ? command->count / seconds : 0,
+            percentileUs(command, 0.50), percentileUs(command, 0.99), command->syscalls);
+}
+
+bool runScenario(const benchScenario *scenario, FILE *json, bool first) {
+    // Baseline run with the setup only, then the measured run on a fresh image
+    char imagePath[128], scriptPath[128];
+    snprintf(imagePath, sizeof(imagePath), "%s/%s.img", workDir, scenario->name);
+    snprintf(scriptPath, sizeof(scriptPath), "%s/%s.txt", workDir, scenario->name);
+
+    benchRun *runs = malloc(2 * sizeof(benchRun));
+    benchRun *baseline = &runs[0], *measured = &runs[1];
+    for (int pass = 0; pass < 2; pass++) {
+        FILE *script = fopen(scriptPath, "w");
+        if (script == NULL) {
+            perror("Error writing script");
+            free(runs);
+            return false;
+        }
+        if (scenario->setup != NULL) {
+            scenario->setup(script);
+        }
+        rngState = 42;
+        if (pass == 1) {
+            scenario->measure(script);
+        }
+        fclose(script);
+        if (!runMkimage(scenario, imagePath) || !runFilesys(scriptPath, imagePath, &runs[pass])) {
+            free(runs);
+            return false;
+        }
+    }
+    unlink(imagePath);
+    unlink(scriptPath);
+    subtractBaseline(measured, baseline);
+
+    // the scenario total merges every measured command
+    benchCommand total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < measured->numCommands; i++) {
+        benchCommand *command = &measured->commands[i];
+        total.count += command->count;
+        total.errors += command->errors;
+        total.totalNs += command->totalNs;
+        total.syscalls += command->syscalls;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            total.buckets[b] += command->buckets[b];
+        }
+    }
+    fprintf(json, "%s\n    {\"name\": \"%s\", ", first ? "" : ",", scenario->name);
+    printLatency(json, &total);
+    fprintf(json, ", \"command_seconds\": %.6f, \"wall_seconds\": %.6f, \"exit_status\": %d,\n",
+            total.totalNs / 1e9, measured->wallSeconds, measured->exitStatus);
+
+    // image I/O of the backend, primitives the commands did not use are left out
+    fprintf(json, "     \"io\": {");
+    int listed = 0;
+    for (int i = 0; i < measured->numIO; i++) {
+        if (measured->io[i].calls == 0 && measured->io[i].bytes == 0) {
+            continue;
+        }
+        fprintf(json, "%s\"%s\": {\"calls\": %" PRIu64 ", \"bytes\": %" PRIu64 "}", listed++ ? ", " : "",
+                measured->io[i].name, measured->io[i].calls, measured->io[i].bytes);
+    }
+    fprintf(json, "},\n");
+
+    // per command breakdown, in the order filesys first ran them
+    fprintf(json, "     \"commands\": {");
+    listed = 0;
+    for (int i = 0; i < measured->numCommands; i++) {
+        if (measured->commands[i].count == 0) {
+            continue;
+        }
+        fprintf(json, "%s\"%s\": {", listed++ ? ", " : "", measured->commands[i].name);
+        printLatency(json, &measured->commands[i]);
+        fprintf(json, "}");
+    }
+    fprintf(json, "}}");
+    free(runs);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    const char *only = NULL;
+    const char *outputPath = NULL;
+
+    // Parses options
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--scale") == 0 && hasValue) {
+            scale = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--only") == 0 && hasValue) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "--filesys") == 0 && hasValue) {
+            filesysPath = argv[++i];
+        } else if (strcmp(argv[i], "--mkimage") == 0 && hasValue) {
+            mkimagePath = argv[++i];
+        } else if (strcmp(argv[i], "--filesys-arg") == 0 && hasValue && numFilesysArgs < MAX_FILESYS_ARGS) {
+            filesysArgs[numFilesysArgs++] = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && hasValue) {
+            outputPath = argv[++i];
+        } else {
+            printf("Usage: ./bench [--scale <n>] [--only <scenario>] [--filesys <path>] [--mkimage <path>] "
+                   "[--filesys-arg <arg>]... [-o <json file>]\n");
+            return 1;
+        }
+    }
+    if (scale < 1) {
+        scale = 1;
+    }
+
+    snprintf(workDir, sizeof(workDir), "/tmp/fatbench.XXXXXX");
+    if (mkdtemp(workDir) == NULL) {
+        perror("Error creating work directory");
+        return 1;
+    }
+    FILE *json = outputPath != NULL ? fopen(outputPath, "w") : stdout;
+    if (json == NULL) {
+        perror("Error opening output");
+        return 1;
+    }
+
+    fprintf(json, "{\"filesys\": \"%s\", \"scale\": %d, \"args\": [", filesysPath, scale);
+    for (int i = 0; i < numFilesysArgs; i++) {
+        fprintf(json, "%s\"%s\"", i ? ", " : "", filesysArgs[i]);
+    }
+    fprintf(json, "],\n  \"scenarios\": [");
+    bool ok = true;
+    int ran = 0;
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        if (only != NULL && strcmp(only, scenarios[i].name) != 0) {
+            continue;
+        }
+        fprintf(stderr, "bench: %s\n", scenarios[i].name);
+        if (!runScenario(&scenarios[i], json, ran == 0)) {
+            ok = false;
+            break;
+        }
+        ran++;
+    }
+    fprintf(json, "\n  ]\n}\n");
+    if (json != stdout) {
+        fclose(json);
+    }
+    rmdir(workDir);
+    return ok ? 0 : 1;
+}
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include "lexer.h"
+#include "fat32.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -6,80 +8,294 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <linux/io_uring.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
-// File attributes
-#define ATTR_READ_ONLY   0x01
-#define ATTR_HIDDEN      0x02
-#define ATTR_SYSTEM      0x04
-#define ATTR_VOLUME_ID   0x08
-#define ATTR_DIRECTORY   0x10
-#define ATTR_ARCHIVE     0x20
+// FAT cache settings
+#define FAT_PAGE_SIZE                4096
+#define FAT_DIRTY_THRESHOLD_DEFAULT  256   // dirty pages before an automatic flush
+
+// directory cache settings
+#define DIR_CACHE_BUDGET_DEFAULT     (8 * 1024 * 1024)   // bytes of cached directory entries
+#define DIR_CACHE_BUCKETS            1024
+#define DIR_INDEX_MIN_ENTRIES        64    // directories smaller than this are scanned linearly
+#define DIR_INDEX_EMPTY              -1
+#define DIR_INDEX_DELETED            -2
+
+// path cache settings
+#define PATH_CACHE_SIZE              8192  // slots, a new lookup replaces whatever shares its slot
+#define PATH_MISSING                 1
+#define PATH_DIRECTORY               2
+#define PATH_NOT_DIRECTORY           3
+
+// mmap backend settings, windows are only used when the whole image cannot be mapped
+#define MMAP_WINDOW_SIZE             ((size_t)256 * 1024 * 1024)
+#define MMAP_WINDOWS                 4
+
+// read-ahead window for sequential reads of open files
+#define READ_AHEAD_MIN_CLUSTERS    4
+#define READ_AHEAD_MAX_DEFAULT     (1024 * 1024)   // bytes
+
+// export and import fall back to plain reads and writes through a buffer of this size
+#define HOST_COPY_BUFFER_SIZE   (256 * 1024)
+
+// per open file write buffer, and the total over all files before they are all flushed
+#define WRITE_BUFFER_MAX_DEFAULT   (256 * 1024)        // bytes
+#define WRITE_BUFFER_BUDGET        (8 * 1024 * 1024)   // bytes
+
+// reads of at least this size are split across worker threads by extent
+#define PARALLEL_READ_MIN          (1024 * 1024)   // bytes
+#define PARALLEL_READ_CHUNK_MIN    (64 * 1024)     // smallest piece handed to a worker
+
+// batch mode reads its script through a stdio buffer of this size
+#define BATCH_BUFFER_SIZE   (64 * 1024)
+
+// stats counters, the first IO_SYSCALL_KINDS kinds are syscalls
+#define IO_PREAD          0
+#define IO_PWRITE         1
+#define IO_PREADV         2
+#define IO_PWRITEV        3
+#define IO_MMAP           4
+#define IO_MSYNC          5
+#define IO_URING_ENTER    6
+#define IO_COPY_RANGE     7     // copy_file_range
+#define IO_SENDFILE       8
+#define IO_MMAP_READ      9     // copies out of a mapping
+#define IO_MMAP_WRITE     10    // copies into a mapping
+#define IO_SYSCALL_KINDS  9
+#define IO_STAT_KINDS     11
+#define STATS_MAX_COMMANDS  32
+#define STATS_BUCKETS       32  // bucket b holds latencies below 2^b microseconds
+
+// io_uring backend, at most this many reads are in flight
+#define URING_ENTRIES    256
+
+// buffer cache settings
+#define BUFFER_CACHE_BUDGET_DEFAULT  ((size_t)32 * 1024 * 1024)   // bytes of cached clusters
+#define BUFFER_CACHE_BUCKETS         4096
 
 // Function declarations
 void displayPrompt(char * imageFileName, char *currentDirectory);
-char *get_input(void);
 tokenlist *new_tokenlist(void);
 void add_token(tokenlist *tokens, char *item);
 tokenlist *get_tokens(char *input);
 void free_tokens(tokenlist *tokens);
 void setFATEntry(uint32_t clusterNumber, uint32_t value);
-void open_file_for_read(const char* filename);
-void read_data_from_file(const char* filename, int size);
-void write_data_to_file(const char* filename, const char* data);
+bool open_file_for_read(const char* filename, const char* flags);
+bool read_data_from_file(const char* filename, int size);
+bool write_data_to_file(const char* filename, const char* data);
+bool allocateFile(const char* filename, uint32_t bytes);
 char* getDirectoryNameByCluster(uint32_t parentCluster, uint32_t targetCluster);
 bool changeDirectory(const char *dirname);
 bool makeDirectory(const char *dirname);
 bool createFile(const char *filename);
+bool createFileInDirectory(uint32_t directoryCluster, const char *filename);
 bool removeFile(const char *filename);
 uint32_t getClusterNumber(char *path);
 uint32_t getFATEntry(uint32_t clusterNumber);
+uint32_t getNextCluster(uint32_t currentCluster);
 uint32_t findClusterInDirectory(uint32_t directoryCluster, char *name);
 uint32_t allocateNewCluster();
-uint32_t convert_cluster_to_offset(uint32_t cluster);
+uint32_t allocateContiguousClusters(uint32_t start, uint32_t count);
+uint32_t extendClusterChain(uint32_t lastCluster, uint32_t count);
+uint32_t findFreeRun(uint32_t start, uint32_t count);
+void releaseCluster(uint32_t clusterNumber);
+uint32_t freeClusterChain(uint32_t startCluster, bool isDirectory);
+bool ensureChainLength(uint32_t *startCluster, uint32_t count);
+bool updateFileEntry(uint32_t directoryCluster, const char *filename, uint32_t startCluster, uint32_t size);
+off_t convert_cluster_to_offset(uint32_t cluster);
 uint32_t compute_dentry_offset(uint32_t clusterNumber, const char* filename);
 bool is_directory_empty(uint32_t directoryCluster);
 void remove_directory_entry(uint32_t directoryCluster, char *path);
 bool remove_empty_directory(uint32_t directoryCluster, char *path);
-void print_open_files();
+bool removeEntry(uint32_t directoryCluster, const char *name);
+bool removeTree(const char *name);
+bool print_open_files();
+bool listDirectoryEntries(const char *path);
+bool closeFile(const char* filename);
+bool set_lseek(char* filename, int new_offset);
+char *read_command_line(FILE *in);
+bool runCommand(tokenlist *tokens, bool *quit);
+bool runCommandLine(char *line, bool *quit);
+void shutdownImage();
+void countIO(int kind, ssize_t bytes);
+uint64_t ioSyscallTotal();
+void recordCommandStats(const char *name, bool ok, uint64_t ns, uint64_t syscalls);
+bool runStatsCommand(tokenlist *tokens);
+void printStatsJSON(FILE *out);
+void printStats();
+void resetStats();
+bool copyImageFile(const char *from, const char *to);
+bool replayTrace(const char *path, double speed);
+double secondsSince(struct timespec *start);
+bool loadFATTable();
+bool flushFATTable();
+void freeFATTable();
+bool syncImage();
+bool buildFreeClusterMap();
+uint32_t findFreeCluster(uint32_t start);
+bool writeFSInfo();
+void invalidateDirectoryCache(uint32_t directoryCluster);
+void freeDirectoryCache();
+off_t findFreeDirectorySlot(uint32_t directoryCluster);
+bool compareDirectoryEntryName(const char *dirName, const char *inputName);
+void invalidatePathCache(uint32_t parentCluster, const char *name);
+void invalidatePathCacheDirectory(uint32_t parentCluster);
+bool initImageIO(const char *backendName);
+bool initImage();
+void closeImageIO();
+ssize_t imageRead(void *buf, size_t len, off_t offset);
+ssize_t imageWrite(const void *buf, size_t len, off_t offset);
+char *imageMap(off_t offset, size_t len);
+bool imageSync();
+ssize_t imageReadv(const struct iovec *iov, int count, off_t offset);
+ssize_t imageWritev(const struct iovec *iov, int count, off_t offset);
+bool bufferCacheFillRuns(const uint32_t *firstClusters, const uint32_t *counts, int numRuns);
+char *bufferCacheGet(uint32_t cluster, bool load);
+void bufferCacheRelease(uint32_t cluster, bool dirty);
+bool bufferCacheFill(uint32_t firstCluster, uint32_t count);
+ssize_t bufferCacheRead(void *buf, size_t len, off_t offset);
+ssize_t bufferCacheWrite(const void *buf, size_t len, off_t offset);
+bool flushBufferCache();
+void freeBufferCache();
+void canonicalEntryName(const char *name, char *out);
+bool checkEntryName(const char *name);
+uint32_t hashEntryName(const char *canonical);
+
+// One piece of a scattered read, a vector of buffers at one image offset
+typedef struct {
+    const struct iovec *iov;
+    int iovcnt;
+    off_t offset;
+} ioSegment;
+
+// Block access backend, every read and write of the image goes through one of these
+typedef struct {
+    const char *name;
+    ssize_t (*read)(void *buf, size_t len, off_t offset);
+    ssize_t (*write)(const void *buf, size_t len, off_t offset);
+    ssize_t (*readv)(const struct iovec *iov, int count, off_t offset);
+    ssize_t (*writev)(const struct iovec *iov, int count, off_t offset);
+    bool (*readBatch)(const ioSegment *segments, int count);   // all segments, in any order
+    char *(*map)(off_t offset, size_t len);   // direct pointer into the image or NULL
+    bool (*sync)(void);
+    void (*close)(void);
+} ioBackend;
+
+// I/O counter of one kind of backend call
+typedef struct {
+    uint64_t calls;
+    uint64_t bytes;
+} ioCounter;
+
+// Latency and syscall totals of one shell command
+typedef struct {
+    char name[16];
+    uint64_t count;
+    uint64_t errors;
+    uint64_t totalNs;
+    uint64_t maxNs;
+    uint64_t syscalls;
+    uint64_t maxSyscalls;
+    uint64_t buckets[STATS_BUCKETS];
+} commandStats;
+
+// One cached cluster of the data region
+typedef struct cacheBlock {
+    uint32_t cluster;
+    char *data;
+    int dirty;
+    int pins;                         // pinned blocks are never evicted
+    struct cacheBlock *prev, *next;   // LRU order, head is most recently used
+    struct cacheBlock *hashNext;
+} cacheBlock;
 
-// structure for FAT32 Image
-struct imageStruct {
+// Submission and completion rings shared with the kernel
+typedef struct {
     int fd;
-    uint16_t BpSect;
-    uint8_t sectpClus;
-    uint8_t numFATs;
-    int16_t rsvSecCnt;
-    uint32_t secpFAT;
-    uint32_t rootClus;
-    uint32_t totalSec;
-    uint32_t totalDataClus;
-    uint32_t entpFAT;
-    uint32_t dataStartOffset;
-    int64_t size;
-};
-
-// structure for directories
-typedef struct __attribute__((packed)) directoryEntry {
-    char DIR_Name[11];
-    uint8_t DIR_Attr;
-    char padding_1[8]; //unused fields
-    uint16_t DIR_FstClusHI;
-    char padding_2[4]; //unused fields
-    uint16_t DIR_FstClusLO;
-    uint32_t DIR_FileSize;
-} directoryEntry;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+} uringState;
+
+// One mapped window of the image
+typedef struct {
+    char *base;
+    off_t start;
+    size_t len;
+    unsigned long lastUse;
+} mmapWindow;
+
+// Parsed entries of one directory, kept in an LRU list
+typedef struct dirCacheNode {
+    uint32_t cluster;                 // first cluster of the directory
+    directoryEntry *entries;
+    off_t *offsets;                   // image offset of each entry
+    int numEntries;
+    int32_t *index;                   // open addressing table of entry numbers hashed by name
+    uint32_t indexSize;
+    uint32_t indexDeleted;
+    int32_t *offsetIndex;             // open addressing table of entry numbers hashed by image offset
+    uint32_t offsetIndexSize;
+    int freeHint;                     // no free slot below this entry
+    size_t bytes;
+    struct dirCacheNode *prev, *next; // LRU order, head is most recently used
+    struct dirCacheNode *hashNext;
+} dirCacheNode;
+
+// Result of looking one path component up in a directory
+typedef struct {
+    uint32_t parent;     // first cluster of the directory searched
+    char name[11];       // component padded like an entry name
+    uint8_t kind;        // 0 when the slot is unused, PATH_MISSING for negative entries
+    uint32_t cluster;
+} pathCacheEntry;
+
+// Run of contiguous clusters inside an opened file
+typedef struct {
+    uint32_t file_cluster;   // index of the run's first cluster within the file
+    uint32_t start_cluster;  // cluster number of the run's first cluster
+    uint32_t count;
+} file_extent;
 
 // Structure for files that have been opened
 typedef struct {
-    char name[11];
+    char name[12];
     int is_open;
     uint32_t start_cluster;
     uint32_t size;
     uint32_t offset;
     uint8_t access_mode;
+    uint32_t dir_cluster;
     char path[64];
+    file_extent *extents;    // built from the cluster chain on first use
+    uint32_t num_extents;
+    uint32_t extent_capacity;
+    int extents_valid;
+    uint32_t ra_next;        // offset a sequential read would start at
+    uint32_t ra_window;      // read-ahead window in clusters, 0 when access is random
+    uint32_t ra_end;         // file offset up to which clusters were prefetched
+    char *wb_data;           // writes not yet given to the chain, merged while adjacent
+    uint32_t wb_start;       // file offset of wb_data[0]
+    uint32_t wb_len;
+    uint32_t wb_cap;
+    uint32_t wb_disk_size;   // size in the directory entry while writes are buffered
 } open_file;
 
+// open_file access modes
+#define MODE_READ   0x01
+#define MODE_WRITE  0x02
+
 // Initializes global variables and functions
 struct imageStruct *image;
 struct directoryEntry *directoryEntries = NULL;
@@ -87,7 +303,114 @@ open_file *opened_files = NULL;
 int numOpenedFiles = 0;
 int numDirectoryEntries = 0;
 
+// directory cache, directoryEntries points into its most recently loaded node
+dirCacheNode *dirCacheBuckets[DIR_CACHE_BUCKETS];
+dirCacheNode *dirCacheHead = NULL;
+dirCacheNode *dirCacheTail = NULL;
+size_t dirCacheBytes = 0;
+size_t dirCacheBudget = DIR_CACHE_BUDGET_DEFAULT;
+struct dirCacheNode *currentDirectoryNode = NULL;
+
+// (parent cluster, name) -> cluster cache used when resolving paths
+pathCacheEntry pathCache[PATH_CACHE_SIZE];
+
+// selected block access backend
+ioBackend *imageIO = NULL;
+extern ioBackend fdBackend;
+char *mmapBase = NULL;
+mmapWindow mmapWindows[MMAP_WINDOWS];
+unsigned long mmapClock = 0;
+uringState uring;
+
+// buffer cache of data clusters in front of the backend
+cacheBlock *bufferCacheBuckets[BUFFER_CACHE_BUCKETS];
+cacheBlock *bufferCacheHead = NULL;
+cacheBlock *bufferCacheTail = NULL;
+size_t bufferCacheBytes = 0;
+size_t bufferCacheBudget = BUFFER_CACHE_BUDGET_DEFAULT;
+uint32_t bufferCacheDirty = 0;
+uint32_t readAheadMax = READ_AHEAD_MAX_DEFAULT;
+
+// write coalescing, writeBufferMax 0 writes straight through
+uint32_t writeBufferMax = WRITE_BUFFER_MAX_DEFAULT;
+size_t writeBufferBytes = 0;
+
+// worker threads for large reads, 0 until main picks the number of cores
+int readThreads = 0;
+
+// One piece of a parallel read, an image range copied to its place in the output
+typedef struct {
+    char *dest;
+    off_t offset;
+    uint32_t len;
+} readJob;
+
+// Shared by the workers of one parallel read, each takes the next job until none are left
+typedef struct {
+    readJob *jobs;
+    int numJobs;
+    int next;
+    bool failed;
+} readPool;
+
+// batch mode skips the prompt and prints one result line per command
+bool batchMode = false;
+int commandCount = 0;
+
+// also loop mount the image at ./mnt while the shell runs
+bool kernelMount = false;
+
+// counters for the stats command
+const char *ioStatNames[IO_STAT_KINDS] = { "pread", "pwrite", "preadv", "pwritev", "mmap", "msync", "io_uring_enter", "copy_file_range", "sendfile", "mmap_read", "mmap_write" };
+ioCounter ioStats[IO_STAT_KINDS];
+commandStats commandStatsTable[STATS_MAX_COMMANDS];
+int numCommandStats = 0;
+uint64_t bufferCacheHits = 0;
+uint64_t bufferCacheMisses = 0;
+uint64_t bufferCachePrefetched = 0;
+char *statsJsonPath = NULL;
+
+// --record trace, times are seconds since the session started
+FILE *recordFile = NULL;
+struct timespec sessionStart;
+
+// in-memory copy of the first FAT, written back one run of dirty pages at a time
+uint32_t *fatTable = NULL;
+uint32_t fatSizeBytes = 0;
+uint32_t fatNumPages = 0;
+uint8_t *fatDirtyPages = NULL;
+uint32_t fatDirtyCount = 0;
+uint32_t fatDirtyThreshold = FAT_DIRTY_THRESHOLD_DEFAULT;
+
+// one bit per cluster, set while the cluster is in use
+uint64_t *freeClusterMap = NULL;
+uint32_t freeClusterWords = 0;
+uint32_t freeClusterCount = 0;
+uint32_t nextFreeHint = 2;
+
 directoryEntry* find_file_in_directory(const char* filename);
+bool load_file_extents(open_file *file);
+void invalidate_file_extents(open_file *file);
+bool ensure_file_clusters(open_file *file, uint32_t count);
+off_t map_file_offset(open_file *file, uint32_t offset, uint32_t *run_bytes);
+void read_ahead_file(open_file *file, uint32_t size);
+uint32_t prefetch_file_range(open_file *file, uint32_t pos, uint32_t end);
+bool use_parallel_read(uint32_t size);
+bool export_file(const char *filename, const char *hostpath);
+bool copy_fd_range(int inFd, off_t *inOffset, int outFd, off_t *outOffset, size_t len);
+bool import_file(const char *hostpath, const char *filename);
+bool create_sized_file(uint32_t directoryCluster, const char *filename, uint32_t size, open_file *file);
+void discard_new_file(uint32_t directoryCluster, const char *filename, uint32_t startCluster);
+bool copyFile(const char *source, const char *destination);
+bool moveEntry(const char *source, const char *destination);
+bool resolveDestination(const char *destination, const char *source, uint32_t *directoryCluster, char *name);
+uint32_t parentDirectoryCluster(uint32_t directoryCluster);
+void bufferCacheInvalidate(uint32_t firstCluster, uint32_t count);
+void dropBufferCacheBlock(cacheBlock *block);
+bool write_file_range(open_file *file, const char *data, uint32_t dataOffset, uint32_t dataLength);
+bool flush_write_buffer(open_file *file);
+bool flush_write_buffers();
+bool parallel_read_file(open_file *file, char *buffer, uint32_t pos, uint32_t size);
 
 //used to manage what directory we are in and path information
 char* currentDirectory;
@@ -99,125 +422,430 @@ int pathSize = 0;
 int main(int argc, char *argv[]) {
     char command[100];
     int status;
+    char *imageFileName = NULL;
+    const char *backendName = "fd";
+    char *batchFile = NULL;
+    char *recordPath = NULL;
+    char *replayPath = NULL;
+    char replayImage[PATH_MAX];
+    double replaySpeed = 1.0;
+    char *commandString = NULL;
+    bool keepGoing = false;
 
-    if (argc != 2) {
-        printf("Argument error: ./filesys <FAT32 image file>\n");
-        return 1;
+    // Parses options, the last remaining argument is the image
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fat-dirty-pages") == 0 && i + 1 < argc) {
+            fatDirtyThreshold = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            backendName = "mmap";
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            backendName = "io_uring";
+        } else if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc) {
+            bufferCacheBudget = (size_t)strtoul(argv[++i], NULL, 10) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--read-ahead-kb") == 0 && i + 1 < argc) {
+            readAheadMax = (uint32_t)strtoul(argv[++i], NULL, 10) * 1024;
+        } else if (strcmp(argv[i], "--write-buffer-kb") == 0 && i + 1 < argc) {
+            writeBufferMax = (uint32_t)strtoul(argv[++i], NULL, 10) * 1024;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            readThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dir-cache-kb") == 0 && i + 1 < argc) {
+            dirCacheBudget = (size_t)strtoul(argv[++i], NULL, 10) * 1024;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batchFile = argv[++i];
+            batchMode = true;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            commandString = argv[++i];
+            batchMode = true;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replayPath = argv[++i];
+            batchMode = true;
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            replaySpeed = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--max") == 0) {
+            replaySpeed = 0;
+        } else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            statsJsonPath = argv[++i];
+        } else if (strcmp(argv[i], "--kernel-mount") == 0) {
+            kernelMount = true;
+        } else if (strcmp(argv[i], "--keep-going") == 0) {
+            keepGoing = true;
+        } else if (imageFileName == NULL && argv[i][0] != '-') {
+            imageFileName = argv[i];
+        } else {
+            imageFileName = NULL;
+            break;
+        }
     }
-    // Initializes the image
-    sprintf(command, "sudo mount -o loop %s ./mnt ", argv[1]);
-    status = system(command);
-    if (status == -1) {
-        perror("mount failed");
+    if (imageFileName == NULL) {
+        printf("Argument error: ./filesys [--mmap | --io-uring] [--cache-mb <n>] [--read-ahead-kb <n>] [--threads <n>] [--write-buffer-kb <n>] [--fat-dirty-pages <n>] [--dir-cache-kb <n>] [--batch <script> | -c \"cmd; cmd\"] [--keep-going] [--record <trace> | --replay <trace> [--speed <n> | --max]] [--stats-json <file>] [--kernel-mount] <FAT32 image file>\n");
         return 1;
     }
+    if (readThreads <= 0) {
+        readThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    // The image is parsed in process, a kernel loop mount is only made on request
+    if (kernelMount) {
+        sprintf(command, "sudo mount -o loop %s ./mnt ", imageFileName);
+        status = system(command);
+        if (status == -1) {
+            perror("mount failed");
+            return 1;
+        }
+    }
+
+    // A replay runs against a copy so the original image stays as it was
+    if (replayPath != NULL) {
+        snprintf(replayImage, sizeof(replayImage), "%s.replay", imageFileName);
+        if (!copyImageFile(imageFileName, replayImage)) {
+            return 1;
+        }
+        imageFileName = replayImage;
+    }
 
-    image = malloc(sizeof(struct imageStruct));
-    image->fd = open(argv[1], O_RDWR);
+    // Initializes the image
+    clock_gettime(CLOCK_MONOTONIC, &sessionStart);
+    image = calloc(1, sizeof(struct imageStruct));
+    image->fd = open(imageFileName, O_RDWR);
     struct stat fileInfo;
-    stat(argv[1], &fileInfo);
-    image->size = (int64_t)fileInfo.st_size;
-    initImage(image);
-    // Display prompt while loop
-    while (1) {
-        displayPrompt(argv[1], currentDirectory);
-        char *input = get_input();
-        tokenlist *tokens = get_tokens(input);
-
-        if (strcmp(tokens->items[0], "exit") == 0) {
-            free(input);
-	    free(tokens);
-	    sprintf(command, "sudo umount ./mnt");
-	    system(command);
-            break;
+    if (image->fd >= 0 && fstat(image->fd, &fileInfo) == 0) {
+        image->size = (int64_t)fileInfo.st_size;
+    }
+    if (image->fd < 0 || !initImageIO(backendName)) {
+        perror("Error opening image");
+        return 1;
+    }
+    if (!initImage() || !loadFATTable() || !buildFreeClusterMap()) {
+        return 1;
+    }
+    if (recordPath != NULL) {
+        recordFile = fopen(recordPath, "w");
+        if (recordFile == NULL) {
+            perror("Error opening trace");
+            return 1;
         }
-        if (strcmp(tokens->items[0], "info") == 0) {
-            printImageStruct(image);
+        fprintf(recordFile, "# filesys trace\n# geometry %" PRIu16 " %" PRIu8 " %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRId64 "\n",
+                image->BpSect, image->sectpClus, image->rootClus, image->totalDataClus, image->entpFAT, image->size);
+    }
+    bool quit = false;
+    bool failed = false;
+    if (replayPath != NULL) {
+        failed = !replayTrace(replayPath, replaySpeed);
+        unlink(replayImage);
+    } else if (commandString != NULL) {
+        // -c runs the ';' separated commands in order
+        char *save;
+        for (char *cmd = strtok_r(commandString, ";", &save); cmd != NULL && !quit; cmd = strtok_r(NULL, ";", &save)) {
+            if (!runCommandLine(cmd, &quit)) {
+                failed = true;
+                if (!keepGoing) {
+                    break;
+                }
+            }
         }
-        if (strcmp(tokens->items[0], "ls") == 0) {
-            if (tokens->size >= 2) {
-                listDirectoryEntries(tokens->items[1]);
-            } else {
-                listDirectoryEntries("");
+    } else {
+        // --batch streams a script ("-" for stdin), otherwise prompt for commands
+        FILE *in = stdin;
+        if (batchFile != NULL && strcmp(batchFile, "-") != 0) {
+            in = fopen(batchFile, "r");
+            if (in == NULL) {
+                perror("Error opening batch script");
+                shutdownImage();
+                return 1;
             }
         }
-        if (strcmp(tokens->items[0], "cd") == 0) {
-            if (tokens->size >= 2) {
-		changeDirectory(tokens->items[1]);
-           }
+        if (batchMode) {
+            setvbuf(in, NULL, _IOFBF, BATCH_BUFFER_SIZE);
         }
-	if (strcmp(tokens->items[0], "mkdir") == 0) {
-	    if (tokens->size >= 2) {
-		makeDirectory(tokens->items[1]);
-	    }
-	}
-	if (strcmp(tokens->items[0], "creat") == 0) {
-	    if (tokens->size >= 2) {
-		createFile(tokens->items[1]);
-	    }
-	}
-	if (strcmp(tokens->items[0], "open") == 0) {
-	    if (tokens->size >= 2) {
-		char *filename = tokens->items[1];
-		open_file_for_read(filename);
-	    }
-	}
-	if (strcmp(tokens->items[0], "close") == 0) {
-	    if (tokens->size >= 2) {
-		char *filename = tokens->items[1];
-		closeFile(filename);
-	    }
-	}
-	if (strcmp(tokens->items[0], "read") == 0) {
-	    if (tokens->size >= 3) {
-		char *filename = tokens->items[1];
-		int size = atoi(tokens->items[2]);
-		read_data_from_file(filename, size);
-	    }
-	}
-	if (strcmp(tokens->items[0], "write") == 0) {
-            if (tokens->size >= 3) {
-                char *filename = tokens->items[1];
-                char *data = tokens->items[2];
-                write_data_to_file(filename, data);
+        while (!quit) {
+            if (!batchMode) {
+                displayPrompt(imageFileName, currentDirectory);
+            }
+            char *input = read_command_line(in);
+            if (input == NULL) {
+                break;
+            }
+            bool ok = runCommandLine(input, &quit);
+            free(input);
+            if (!ok) {
+                failed = true;
+                if (batchMode && !keepGoing) {
+                    break;
+                }
             }
         }
-	if (strcmp(tokens->items[0], "rm") == 0) {
-	    if (tokens->size >= 2) {
-		char *filename = tokens->items[1];
-		removeFile(filename);
-	    }
-	}
-	if (strcmp(tokens->items[0], "rmdir") == 0) {
-            if (tokens->size >= 2) {
-                char *target = tokens->items[1];
-		remove_empty_directory(currentClusterNumber, target);
-	    }
-	}
-	if (strcmp(tokens->items[0], "lsof") == 0) {
-            print_open_files();
-	}
-	if (strcmp(tokens->items[0], "lseek") == 0) {
-            if (tokens->size >= 3) {
-                char *filename = tokens->items[1];
-                int offset = atoi(tokens->items[2]);
-                set_lseek(filename, offset);
-            } else {
-                printf("Error: lseek <file> <offset>\n");
+        if (in != stdin) {
+            fclose(in);
+        }
+    }
+
+    shutdownImage();
+    return (batchMode && failed) ? 1 : 0;
+}
+
+bool runCommandLine(char *line, bool *quit) {
+    // Runs one command line, batch mode follows it with a result line
+    if (recordFile != NULL) {
+        fprintf(recordFile, "%.6f\t%s\n", secondsSince(&sessionStart), line);
+    }
+    tokenlist *tokens = get_tokens(line);
+    struct timespec start, end;
+    uint64_t syscallsBefore = ioSyscallTotal();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ok = runCommand(tokens, quit);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long elapsedNs = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+    uint64_t syscallsAfter = ioSyscallTotal();
+    if (tokens->size > 0) {
+        // stats reset zeroes the counters under its own run
+        recordCommandStats(tokens->items[0], ok, elapsedNs, syscallsAfter >= syscallsBefore ? syscallsAfter - syscallsBefore : 0);
+    }
+    if (batchMode && tokens->size > 0) {
+        printf("result\t%d\t%s\t%s\t%ld\n", ++commandCount, ok ? "ok" : "error", tokens->items[0], elapsedNs);
+    }
+    free_tokens(tokens);
+    return ok;
+}
+
+void shutdownImage() {
+    // Writes everything back and releases the image
+    syncImage();
+    if (recordFile != NULL) {
+        fclose(recordFile);
+        recordFile = NULL;
+    }
+    if (statsJsonPath != NULL) {
+        FILE *out = fopen(statsJsonPath, "w");
+        if (out != NULL) {
+            printStatsJSON(out);
+            fclose(out);
+        } else {
+            perror("Error writing stats");
+        }
+    }
+    freeFATTable();
+    free(freeClusterMap);
+    freeDirectoryCache();
+    freeBufferCache();
+    closeImageIO();
+    if (kernelMount) {
+        system("sudo umount ./mnt");
+    }
+}
+
+double secondsSince(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+bool copyImageFile(const char *from, const char *to) {
+    // Copies the image for a replay with copy_fd_range
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    struct stat st;
+    bool ok = in >= 0 && out >= 0 && fstat(in, &st) == 0 && copy_fd_range(in, NULL, out, NULL, st.st_size);
+    if (!ok) {
+        perror("Error copying image for replay");
+    }
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0) {
+        close(out);
+    }
+    return ok;
+}
+
+bool replayTrace(const char *path, double speed) {
+    // Re-runs a --record trace, paced by its timestamps divided by speed (0 runs it flat out)
+    FILE *trace = fopen(path, "r");
+    if (trace == NULL) {
+        perror("Error opening trace");
+        return false;
+    }
+    setvbuf(trace, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+    resetStats();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int commands = 0, errors = 0;
+    bool quit = false;
+    char *line;
+    while (!quit && (line = read_command_line(trace)) != NULL) {
+        if (line[0] == '#') {
+            uint16_t bpSect;
+            uint8_t sectpClus;
+            uint32_t rootClus, dataClus, entpFAT;
+            int64_t size;
+            if (sscanf(line, "# geometry %" SCNu16 " %" SCNu8 " %" SCNu32 " %" SCNu32 " %" SCNu32 " %" SCNd64,
+                       &bpSect, &sectpClus, &rootClus, &dataClus, &entpFAT, &size) == 6 &&
+                (bpSect != image->BpSect || sectpClus != image->sectpClus || dataClus != image->totalDataClus || size != image->size)) {
+                printf("Warning: The trace was recorded on an image with a different geometry.\n");
+            }
+            free(line);
+            continue;
+        }
+        char *tab = strchr(line, '\t');
+        if (tab == NULL) {
+            free(line);
+            continue;
+        }
+        double at = strtod(line, NULL);
+        if (speed > 0) {
+            // sleep until the command's time in the trace, scaled by speed
+            double wait = at / speed - secondsSince(&start);
+            if (wait > 0) {
+                struct timespec pause = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+                while (nanosleep(&pause, &pause) != 0 && errno == EINTR) {
+                }
             }
         }
-        free(input);
-        free_tokens(tokens);
+        commands++;
+        if (!runCommandLine(tab + 1, &quit)) {
+            errors++;
+        }
+        free(line);
     }
+    fclose(trace);
 
-    return 0;
+    double elapsed = secondsSince(&start);
+    printf("replay: %d commands in %.3f s, %.1f commands/s, %d errors\n",
+           commands, elapsed, elapsed > 0 ? commands / elapsed : 0, errors);
+    printStats();
+    return true;
+}
+
+bool runCommand(tokenlist *tokens, bool *quit) {
+    // Runs one tokenized command and returns whether it succeeded
+    if (tokens->size == 0) {
+        return true;
+    }
+    char *cmd = tokens->items[0];
+    // buffered writes only stay pending across writes, reads and seeks of open files,
+    // everything else sees the files as they are in the image. A failed flush fails the
+    // command, except the ones that can give space back or end the session
+    if (strcmp(cmd, "write") != 0 && strcmp(cmd, "read") != 0 && strcmp(cmd, "lseek") != 0
+        && strcmp(cmd, "lsof") != 0 && !flush_write_buffers()
+        && strcmp(cmd, "exit") != 0 && strcmp(cmd, "rm") != 0 && strcmp(cmd, "rmdir") != 0) {
+        return false;
+    }
+    if (strcmp(cmd, "exit") == 0) {
+        *quit = true;
+        return true;
+    }
+    if (strcmp(cmd, "info") == 0) {
+        printImageStruct(image);
+        return true;
+    }
+    if (strcmp(cmd, "sync") == 0) {
+        return syncImage();
+    }
+    if (strcmp(cmd, "ls") == 0) {
+        return listDirectoryEntries(tokens->size >= 2 ? tokens->items[1] : "");
+    }
+    if (strcmp(cmd, "cd") == 0) {
+        return tokens->size >= 2 && changeDirectory(tokens->items[1]);
+    }
+    if (strcmp(cmd, "mkdir") == 0) {
+        return tokens->size >= 2 && makeDirectory(tokens->items[1]);
+    }
+    if (strcmp(cmd, "creat") == 0) {
+        return tokens->size >= 2 && createFile(tokens->items[1]);
+    }
+    if (strcmp(cmd, "open") == 0) {
+        return tokens->size >= 2 && open_file_for_read(tokens->items[1], tokens->size >= 3 ? tokens->items[2] : "-r");
+    }
+    if (strcmp(cmd, "close") == 0) {
+        return tokens->size >= 2 && closeFile(tokens->items[1]);
+    }
+    if (strcmp(cmd, "read") == 0) {
+        return tokens->size >= 3 && read_data_from_file(tokens->items[1], atoi(tokens->items[2]));
+    }
+    if (strcmp(cmd, "write") == 0) {
+        return tokens->size >= 3 && write_data_to_file(tokens->items[1], tokens->items[2]);
+    }
+    if (strcmp(cmd, "cat") == 0) {
+        // cat <file> [> hostpath]
+        if (tokens->size == 2) {
+            return export_file(tokens->items[1], NULL);
+        }
+        if (tokens->size == 4 && strcmp(tokens->items[2], ">") == 0) {
+            return export_file(tokens->items[1], tokens->items[3]);
+        }
+        if (tokens->size == 3 && tokens->items[2][0] == '>' && tokens->items[2][1] != '\0') {
+            return export_file(tokens->items[1], tokens->items[2] + 1);
+        }
+        printf("Error: cat <file> [> hostpath]\n");
+        return false;
+    }
+    if (strcmp(cmd, "export") == 0) {
+        if (tokens->size < 3) {
+            printf("Error: export <file> <hostpath>\n");
+            return false;
+        }
+        return export_file(tokens->items[1], tokens->items[2]);
+    }
+    if (strcmp(cmd, "import") == 0) {
+        if (tokens->size < 3) {
+            printf("Error: import <hostpath> <file>\n");
+            return false;
+        }
+        return import_file(tokens->items[1], tokens->items[2]);
+    }
+    if (strcmp(cmd, "cp") == 0) {
+        if (tokens->size < 3) {
+            printf("Error: cp <source> <destination>\n");
+            return false;
+        }
+        return copyFile(tokens->items[1], tokens->items[2]);
+    }
+    if (strcmp(cmd, "mv") == 0) {
+        if (tokens->size < 3) {
+            printf("Error: mv <source> <destination>\n");
+            return false;
+        }
+        return moveEntry(tokens->items[1], tokens->items[2]);
+    }
+    if (strcmp(cmd, "fallocate") == 0) {
+        if (tokens->size < 3) {
+            printf("Error: fallocate <file> <bytes>\n");
+            return false;
+        }
+        return allocateFile(tokens->items[1], (uint32_t)strtoul(tokens->items[2], NULL, 10));
+    }
+    if (strcmp(cmd, "rm") == 0) {
+        if (tokens->size >= 3 && strcmp(tokens->items[1], "-r") == 0) {
+            return removeTree(tokens->items[2]);
+        }
+        return tokens->size >= 2 && removeFile(tokens->items[1]);
+    }
+    if (strcmp(cmd, "rmdir") == 0) {
+        return tokens->size >= 2 && remove_empty_directory(currentClusterNumber, tokens->items[1]);
+    }
+    if (strcmp(cmd, "lsof") == 0) {
+        return print_open_files();
+    }
+    if (strcmp(cmd, "stats") == 0) {
+        return runStatsCommand(tokens);
+    }
+    if (strcmp(cmd, "lseek") == 0) {
+        if (tokens->size < 3) {
+            printf("Error: lseek <file> <offset>\n");
+            return false;
+        }
+        return set_lseek(tokens->items[1], atoi(tokens->items[2]));
+    }
+    printf("Error: Unknown command '%s'.\n", cmd);
+    return false;
 }
 
 bool compareDirectoryEntryName(const char *dirName, const char *inputName) {
     //iterate through each character in the directory entry name
     for (int j = 0; j < 11; ++j) {
-        if (dirName[j] == ' ' && inputName[j] == '\0') {
-            return true;
+        // the input ends here, names written by creat are padded with zeros instead of spaces
+        if (inputName[j] == '\0') {
+            return dirName[j] == ' ' || dirName[j] == '\0';
         }
         if (dirName[j] != inputName[j]) {
             return false;
@@ -230,6 +858,7 @@ bool changeDirectory(const char *dirname) {
     // handle case where we change to parent directory
     if (strcmp(dirname, "..") == 0) {
         if (pathIndex >= 0) {
+            // clusterPath holds the directory we came from
             currentClusterNumber = clusterPath[pathIndex];
             pathIndex--;
             // update currentDirectory to remove the last directory name
@@ -253,8 +882,8 @@ bool changeDirectory(const char *dirname) {
 	return false;
     }
     // Change current cluster number
-    currentClusterNumber = newCluster;
     uint32_t parentCluster = currentClusterNumber;
+    currentClusterNumber = newCluster;
 
     // Create a new path for the directory
     char *newPath = NULL;
@@ -274,7 +903,7 @@ bool changeDirectory(const char *dirname) {
 
     // store current cluster number in array and reallocate memory if necessary
     if (pathIndex >= pathSize - 1) {
-        uint32_t *temp = (uint32_t)realloc(clusterPath, (pathSize + 1) * sizeof(uint32_t));
+        uint32_t *temp = (uint32_t *)realloc(clusterPath, (pathSize + 1) * sizeof(uint32_t));
         if (temp == NULL) {
             printf("Memory allocation error.\n");
             return false;
@@ -282,9 +911,9 @@ bool changeDirectory(const char *dirname) {
         clusterPath = temp;
         pathSize++;
     }
-    // store current cluster number and update path index
+    // store parent cluster number and update path index
     pathIndex++;
-    clusterPath[pathIndex] = currentClusterNumber;
+    clusterPath[pathIndex] = parentCluster;
 
     return true;
 }
@@ -292,23 +921,62 @@ bool changeDirectory(const char *dirname) {
 uint32_t getClusterNumber(char *path){
 	// returns the current cluster number for a specific path or directory
 	char *path_copy = strdup(path);
+	char *save = NULL;
 	uint32_t currentCluster = currentClusterNumber;
-	char *token = strtok(path, "/");
+	char *token = strtok_r(path_copy, "/", &save);
 
 	while (token != NULL){
 		uint32_t nextCluster = findClusterInDirectory(currentCluster,token);
 		
 		if (nextCluster == 0){
 			printf("Directory '%s' not found.\n", token);
+			free(path_copy);
             		return 0;
 		}
 		currentCluster = nextCluster;
-        	token = strtok(NULL, "/");
+        	token = strtok_r(NULL, "/", &save);
 	}
+	free(path_copy);
 	return currentCluster;
 }
 
+pathCacheEntry *pathCacheSlot(uint32_t parentCluster, const char *canonical) {
+    // Returns the slot a (parent, name) pair maps to
+    uint32_t hash = hashEntryName(canonical) ^ (parentCluster * 2654435761u);
+    return &pathCache[hash % PATH_CACHE_SIZE];
+}
+
+void invalidatePathCache(uint32_t parentCluster, const char *name) {
+    // Forgets the cached lookup of one name in a directory
+    char key[11];
+    canonicalEntryName(name, key);
+    pathCacheEntry *slot = pathCacheSlot(parentCluster, key);
+    if (slot->kind != 0 && slot->parent == parentCluster && memcmp(slot->name, key, 11) == 0) {
+        slot->kind = 0;
+    }
+}
+
+void invalidatePathCacheDirectory(uint32_t parentCluster) {
+    // Forgets every cached lookup inside a directory, used when its cluster is freed or reused
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+        if (pathCache[i].parent == parentCluster) {
+            pathCache[i].kind = 0;
+        }
+    }
+}
+
 uint32_t findClusterInDirectory(uint32_t directoryCluster, char *name) {
+    // answer from the path cache when this lookup was done before
+    char key[11];
+    canonicalEntryName(name, key);
+    pathCacheEntry *slot = pathCacheSlot(directoryCluster, key);
+    if (slot->kind != 0 && slot->parent == directoryCluster && memcmp(slot->name, key, 11) == 0) {
+        if (slot->kind == PATH_NOT_DIRECTORY) {
+            printf("'%s' is not a directory.\n", name);
+        }
+        return slot->cluster;
+    }
+
     // load directory entries for the specified cluster
     loadDirectoryEntries(directoryCluster);
 
@@ -317,16 +985,26 @@ uint32_t findClusterInDirectory(uint32_t directoryCluster, char *name) {
         return 0; // Return an appropriate value indicating error
     }
 
-    // iterate through directory entries to find the matching one
-    for (int i = 0; i < numDirectoryEntries; ++i) {
-        if (compareDirectoryEntryName(directoryEntries[i].DIR_Name, name)) {
-            if (directoryEntries[i].DIR_Attr == ATTR_DIRECTORY) {
-                uint32_t cluster_num = (uint32_t)(((uint32_t)directoryEntries[i].DIR_FstClusHI << 16) | directoryEntries[i].DIR_FstClusLO);
-                return cluster_num;
-            } else {
-                printf("'%s' is not a directory.\n", name);
-                return 0;
+    // look the name up in the directory, remembering misses too
+    directoryEntry *entry = find_file_in_directory(name);
+    slot->parent = directoryCluster;
+    memcpy(slot->name, key, 11);
+    slot->kind = PATH_MISSING;
+    slot->cluster = 0;
+    if (entry != NULL) {
+        if (entry->DIR_Attr == ATTR_DIRECTORY) {
+            uint32_t cluster_num = (uint32_t)(((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO);
+            // '..' entries pointing at the root store cluster 0
+            if (cluster_num == 0) {
+                cluster_num = image->rootClus;
             }
+            slot->kind = PATH_DIRECTORY;
+            slot->cluster = cluster_num;
+            return cluster_num;
+        } else {
+            slot->kind = PATH_NOT_DIRECTORY;
+            printf("'%s' is not a directory.\n", name);
+            return 0;
         }
     }
 
@@ -335,579 +1013,3235 @@ uint32_t findClusterInDirectory(uint32_t directoryCluster, char *name) {
 
 uint32_t getFATEntry(uint32_t clusterNumber) {
     // Returns the FAT Entry from a cluster
-    uint32_t offset = image->rsvSecCnt * image->BpSect + clusterNumber * 4;
-    uint32_t fatEntry;
-
-    lseek(image->fd, offset, SEEK_SET);
-    read(image->fd, &fatEntry, 4);
-
-    return fatEntry & 0x0FFFFFFF;
+    if (clusterNumber >= image->entpFAT) {
+        return FAT_EOC;
+    }
+    return fatTable[clusterNumber] & FAT_ENTRY_MASK;
 }
 
 uint32_t allocateNewCluster() {
     // Allocates a new cluster for directories/files
-    for (uint32_t i = 2; i < image->totalDataClus; i++) {
-	uint32_t fatEntry = getFATEntry(i);
-	if (fatEntry == 0) {
-	    setFATEntry(i, 0x0FFFFFFF);
-	    return i;
-	}
+    uint32_t i = findFreeCluster(nextFreeHint);
+    if (i == 0) {
+        printf("Error: No free clusters.\n");
+        return 0;
     }
-    printf("Error: No free clusters.\n");
-    return 0;
-}
-
-uint32_t convert_cluster_to_offset(uint32_t cluster) {
-    // Returns the offset of a given cluster
-    uint32_t cluster_size = image->sectpClus * image->BpSect;
-    uint32_t offset = image->dataStartOffset + (cluster - 2) * cluster_size;
-    return offset;
+    freeClusterMap[i / 64] |= 1ULL << (i % 64);
+    freeClusterCount--;
+    nextFreeHint = (i + 1 > image->maxClus) ? 2 : i + 1;
+    setFATEntry(i, FAT_EOC);
+    return i;
 }
 
-void setFATEntry(uint32_t clusterNumber, uint32_t value) {
-    // Sets the FAT Entry of a cluster based on a value
-    uint32_t offset = image->rsvSecCnt * image->BpSect + clusterNumber * 4;
-
-    lseek(image->fd, offset, SEEK_SET);
-    write(image->fd, &value, 4);
-}
-
-
-directoryEntry* encode_dir_entry(int fat32_fd, uint32_t offset) {
-    // Encodes directory entry and reads its bytes
-    directoryEntry *dentry = (directoryEntry*)malloc(sizeof(directoryEntry));
-    ssize_t rd_bytes = pread(fat32_fd, (void*)dentry, sizeof(directoryEntry), offset);
-
-    if (rd_bytes != sizeof(directoryEntry)) {
-        fprintf(stderr, "Error: Failed to read directory entry at offset 0x%x\n", offset);
-        free(dentry);
-        return NULL;
+bool buildFreeClusterMap() {
+    // Builds the free cluster bitmap from the cached FAT
+    freeClusterWords = image->maxClus / 64 + 1;
+    freeClusterMap = malloc((size_t)freeClusterWords * sizeof(uint64_t));
+    if (freeClusterMap == NULL) {
+        printf("Error: Could not allocate the free cluster map.\n");
+        return false;
     }
-
-    return dentry;
-}
-
-int is_valid_name(uint8_t *name) {
-    return 1;
-}
-
-uint32_t convert_clus_num_to_offset_in_fat_region(uint32_t clus_num) {
-    // Given a cluster number, returns its fat region offset
-    uint32_t fat_region_offset = 0x4000;
-    return fat_region_offset + clus_num * 4;
-}
-
-uint32_t getNextCluster(uint32_t currentCluster) {
-    // Finds the next cluster based on the current cluster
-    uint32_t fat32_fd = image->fd;
-    uint32_t max_clus_num = (image->secpFAT * image->BpSect) / image->sectpClus;
-    uint32_t offset = convert_clus_num_to_offset_in_fat_region(currentCluster);
-    uint32_t next_clus_num = 0;
-
-    if (currentCluster >= 2 && currentCluster <= max_clus_num) {
-        offset = convert_clus_num_to_offset_in_fat_region(currentCluster);
-        ssize_t bytesRead = pread(fat32_fd, &next_clus_num, sizeof(uint32_t), offset);
-        if (bytesRead == -1) {
-            perror("Error reading FAT entry");
-            return 0;
+    // clusters 0, 1 and anything past the last data cluster never get handed out
+    memset(freeClusterMap, 0xFF, (size_t)freeClusterWords * sizeof(uint64_t));
+    freeClusterCount = 0;
+    for (uint32_t i = 2; i <= image->maxClus; i++) {
+        if ((fatTable[i] & FAT_ENTRY_MASK) == 0) {
+            freeClusterMap[i / 64] &= ~(1ULL << (i % 64));
+            freeClusterCount++;
         }
-        next_clus_num &= 0x0FFFFFFF;
-        //check for the end of the chain
-	if (next_clus_num >= 0x0FFFFFF8 && next_clus_num <= 0x0FFFFFFF) {
-	    return 0; 
-	}
-        currentCluster = next_clus_num;
     }
-    return next_clus_num;
+    if (nextFreeHint < 2 || nextFreeHint > image->maxClus) {
+        nextFreeHint = 2;
+    }
+    return true;
 }
 
-void loadDirectoryEntries(uint32_t clusterNumber) {
-    int fat32_fd = image->fd;
-    uint32_t clusterSize = image->sectpClus * image->BpSect;
-
-    //reset global list of entries
-    if (directoryEntries != NULL) {
-        free(directoryEntries);
-        directoryEntries = NULL;
+uint32_t findFreeCluster(uint32_t start) {
+    // Returns the first free cluster at or after start, wrapping around once, 0 if full
+    if (start < 2 || start > image->maxClus) {
+        start = 2;
     }
-    numDirectoryEntries = 0;
-
-    //read directory entries from the current cluster and its subsequent clusters
-    while (clusterNumber >= 2) {
-        uint32_t offset = image->dataStartOffset + (clusterNumber - 2) * clusterSize;
-	uint32_t end_offset = image->dataStartOffset + (clusterNumber - 2) * clusterSize + clusterSize;
-        //read directory entries from the current cluster
-        while (1) {
-            //reached the end of a cluster
-            if (offset + sizeof(directoryEntry) > end_offset){
-            	break;
-            }
-            directoryEntry *entry = encode_dir_entry(fat32_fd, offset);
-            if (entry->DIR_Attr == 0x0F) { //skip long file entries
-                offset += sizeof(directoryEntry);
+    uint32_t startWord = start / 64;
+    // the first word ignores the clusters below start, they are checked after wrapping
+    uint64_t first = freeClusterMap[startWord] | ((1ULL << (start % 64)) - 1);
+    if (~first) {
+        return startWord * 64 + __builtin_ctzll(~first);
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t w = (pass == 0) ? startWord + 1 : 0;
+        uint32_t end = (pass == 0) ? freeClusterWords : startWord + 1;
+        while (w < end) {
+            // skip four full words per step, gcc turns this into vector compares
+            if (w + 4 <= end && (freeClusterMap[w] & freeClusterMap[w + 1] & freeClusterMap[w + 2]
+                        & freeClusterMap[w + 3]) == ~0ULL) {
+                w += 4;
                 continue;
             }
-            //check if the entry is a valid file name
-            if (is_valid_name(entry->DIR_Name)) {
-                if (directoryEntries == NULL) {
-                    directoryEntries = malloc(sizeof(directoryEntry));
-                    if (directoryEntries == NULL) {
-                        perror("Error allocating memory for directory entries");
-                        return;
+            if (~freeClusterMap[w]) {
+                return w * 64 + __builtin_ctzll(~freeClusterMap[w]);
+            }
+            w++;
+        }
+    }
+    return 0;
+}
+
+uint32_t findFreeRun(uint32_t start, uint32_t count) {
+    // Returns the first cluster of a run of count free clusters at or after start, wrapping once
+    if (count == 0) {
+        return 0;
+    }
+    if (start < 2 || start > image->maxClus) {
+        start = 2;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t c = (pass == 0) ? start : 2;
+        // the second pass may run into start so runs crossing it are found too
+        uint64_t end = (pass == 0) ? (uint64_t)image->maxClus + 1 : (uint64_t)start + count;
+        uint32_t runStart = 0, runLen = 0;
+        while (c < end && c <= image->maxClus) {
+            uint64_t word = freeClusterMap[c / 64];
+            if (c % 64 == 0 && (word == 0 || word == ~0ULL)) {
+                // whole word free or whole word used
+                if (word == 0) {
+                    if (runLen == 0) {
+                        runStart = c;
                     }
+                    runLen += 64;
+                } else {
+                    runLen = 0;
+                }
+                c += 64;
+            } else {
+                if (word & (1ULL << (c % 64))) {
+                    runLen = 0;
                 } else {
-                    //reallocate memory for directoryEntries
-                    directoryEntry *temp = realloc(directoryEntries, (numDirectoryEntries + 1) * sizeof(directoryEntry));
-                    if (temp == NULL) {
-                        perror("Error reallocating memory for directory entries");
-                        return;
+                    if (runLen == 0) {
+                        runStart = c;
                     }
-                    directoryEntries = temp;
+                    runLen++;
                 }
-
-                //copy the entry to directoryEntries
-                directoryEntries[numDirectoryEntries++] = *entry;
+                c++;
+            }
+            if (runLen >= count) {
+                return runStart;
             }
-            offset += sizeof(directoryEntry);
         }
-
-        //get next cluster in the chain
-        clusterNumber = getNextCluster(clusterNumber);
     }
+    return 0;
 }
 
-void listDirectoryEntries(const char *path) {
-    
-    //compute the cluster number for the specified directory path
-    uint32_t currentCluster = getClusterNumber(path);
-    if (currentCluster == 0) {
-        return;
+void claimClusterRun(uint32_t first, uint32_t count) {
+    // Marks count clusters starting at first as used and links them into one chain
+    for (uint32_t c = first; c < first + count; c++) {
+        freeClusterMap[c / 64] |= 1ULL << (c % 64);
+        setFATEntry(c, (c + 1 < first + count) ? c + 1 : FAT_EOC);
     }
-    //store the directory entries in global list
+    freeClusterCount -= count;
+    nextFreeHint = (first + count > image->maxClus) ? 2 : first + count;
+}
+
+uint32_t allocateContiguousClusters(uint32_t start, uint32_t count) {
+    // Allocates count contiguous clusters at or after start as one chain, returns the first or 0
+    uint32_t first = findFreeRun(start, count);
+    if (first == 0) {
+        return 0;
+    }
+    claimClusterRun(first, count);
+    return first;
+}
+
+void releaseCluster(uint32_t clusterNumber) {
+    // Returns a single cluster to the free map
+    if (clusterNumber < 2 || clusterNumber > image->maxClus) {
+        return;
+    }
+    setFATEntry(clusterNumber, 0);
+    if (freeClusterMap[clusterNumber / 64] & (1ULL << (clusterNumber % 64))) {
+        freeClusterMap[clusterNumber / 64] &= ~(1ULL << (clusterNumber % 64));
+        freeClusterCount++;
+    }
+}
+
+uint32_t freeClusterChain(uint32_t startCluster, bool isDirectory) {
+    // Releases a whole chain in one walk, the FAT changes land in dirty pages that are
+    // written back together; returns the number of clusters freed
+    uint32_t freed = 0;
+    uint32_t c = startCluster;
+    while (c >= 2 && c <= image->maxClus && freed <= image->totalDataClus) {
+        uint32_t next = getNextCluster(c);
+        // nothing cached for the cluster may be written back after it is reused
+        bufferCacheInvalidate(c, 1);
+        if (isDirectory) {
+            invalidateDirectoryCache(c);
+            invalidatePathCacheDirectory(c);
+        }
+        releaseCluster(c);
+        freed++;
+        c = next;
+    }
+    return freed;
+}
+
+uint32_t extendClusterChain(uint32_t lastCluster, uint32_t count) {
+    // Appends count clusters after lastCluster (0 starts a new chain), returns the first new cluster
+    if (count == 0) {
+        return 0;
+    }
+    if (count > freeClusterCount) {
+        printf("Error: No free clusters.\n");
+        return 0;
+    }
+    uint32_t first = 0, tail = lastCluster, remaining = count;
+    while (remaining > 0) {
+        // prefer the clusters right after the tail, then halve the run until one fits
+        uint32_t want = remaining;
+        uint32_t run = 0;
+        while (want > 0) {
+            run = allocateContiguousClusters(tail >= 2 ? tail + 1 : nextFreeHint, want);
+            if (run != 0) {
+                break;
+            }
+            want /= 2;
+        }
+        if (run == 0) {
+            // no run left, roll back what this call already took
+            uint32_t c = first;
+            while (c != 0) {
+                uint32_t next = getNextCluster(c);
+                releaseCluster(c);
+                c = next;
+            }
+            if (lastCluster >= 2) {
+                setFATEntry(lastCluster, FAT_EOC);
+            }
+            printf("Error: No free clusters.\n");
+            return 0;
+        }
+        if (tail >= 2) {
+            setFATEntry(tail, run);
+        }
+        if (first == 0) {
+            first = run;
+        }
+        tail = run + want - 1;
+        remaining -= want;
+    }
+    return first;
+}
+
+bool ensureChainLength(uint32_t *startCluster, uint32_t count) {
+    // Grows the chain starting at *startCluster to at least count clusters in one extent
+    uint32_t length = 0, last = 0;
+    for (uint32_t c = *startCluster; c >= 2 && length < count; c = getNextCluster(c)) {
+        last = c;
+        length++;
+    }
+    if (length >= count) {
+        return true;
+    }
+    uint32_t first = extendClusterChain(last, count - length);
+    if (first == 0) {
+        return false;
+    }
+    if (*startCluster < 2) {
+        *startCluster = first;
+    }
+    return true;
+}
+
+bool writeFSInfo() {
+    // Stores the free count and next free hint in the FSInfo sector and its backup
+    if (image->fsInfoSec == 0 || image->fsInfoSec == 0xFFFF) {
+        return true;
+    }
+    uint32_t fields[2] = { freeClusterCount, nextFreeHint };
+    uint16_t sectors[2] = { image->fsInfoSec, image->fsInfoBackupSec };
+    for (int i = 0; i < 2; i++) {
+        if (sectors[i] == 0) {
+            continue;
+        }
+        off_t offset = (off_t)sectors[i] * image->BpSect + 488;
+        if (imageWrite(fields, sizeof(fields), offset) != sizeof(fields)) {
+            perror("Error writing FSInfo");
+            return false;
+        }
+    }
+    return true;
+}
+
+off_t convert_cluster_to_offset(uint32_t cluster) {
+    // Returns the offset of a given cluster
+    uint32_t cluster_size = image->sectpClus * image->BpSect;
+    off_t offset = image->dataStartOffset + (off_t)(cluster - 2) * cluster_size;
+    return offset;
+}
+
+void setFATEntry(uint32_t clusterNumber, uint32_t value) {
+    // Sets the FAT Entry of a cluster based on a value, keeping the reserved top 4 bits
+    if (clusterNumber >= image->entpFAT) {
+        return;
+    }
+    fatTable[clusterNumber] = (fatTable[clusterNumber] & ~FAT_ENTRY_MASK) | (value & FAT_ENTRY_MASK);
+
+    // mark the page holding the entry dirty and flush once enough pages piled up
+    uint32_t page = (clusterNumber * 4) / FAT_PAGE_SIZE;
+    if (!(fatDirtyPages[page / 8] & (1 << (page % 8)))) {
+        fatDirtyPages[page / 8] |= 1 << (page % 8);
+        fatDirtyCount++;
+    }
+    if (fatDirtyThreshold > 0 && fatDirtyCount >= fatDirtyThreshold) {
+        flushFATTable();
+    }
+}
+
+bool loadFATTable() {
+    // Reads the whole first FAT into a page aligned buffer
+    fatSizeBytes = image->secpFAT * image->BpSect;
+    fatNumPages = (fatSizeBytes + FAT_PAGE_SIZE - 1) / FAT_PAGE_SIZE;
+
+    if (posix_memalign((void **)&fatTable, FAT_PAGE_SIZE, (size_t)fatNumPages * FAT_PAGE_SIZE) != 0) {
+        printf("Error: Could not allocate memory for the FAT.\n");
+        fatTable = NULL;
+        return false;
+    }
+    memset(fatTable, 0, (size_t)fatNumPages * FAT_PAGE_SIZE);
+    fatDirtyPages = calloc((fatNumPages + 7) / 8, 1);
+    fatDirtyCount = 0;
+
+    off_t fatOffset = (off_t)image->rsvSecCnt * image->BpSect;
+    uint32_t done = 0;
+    while (done < fatSizeBytes) {
+        ssize_t bytesRead = imageRead((char *)fatTable + done, fatSizeBytes - done, fatOffset + done);
+        if (bytesRead <= 0) {
+            perror("Error reading FAT");
+            freeFATTable();
+            return false;
+        }
+        done += bytesRead;
+    }
+    return true;
+}
+
+bool flushFATTable() {
+    // Writes every run of consecutive dirty pages to each FAT copy in one pwrite
+    if (fatTable == NULL || fatDirtyCount == 0) {
+        return true;
+    }
+    bool ok = true;
+    uint32_t page = 0;
+    while (page < fatNumPages) {
+        if (!(fatDirtyPages[page / 8] & (1 << (page % 8)))) {
+            page++;
+            continue;
+        }
+        uint32_t runStart = page;
+        while (page < fatNumPages && (fatDirtyPages[page / 8] & (1 << (page % 8)))) {
+            page++;
+        }
+        uint32_t start = runStart * FAT_PAGE_SIZE;
+        uint32_t end = page * FAT_PAGE_SIZE;
+        if (end > fatSizeBytes) {
+            end = fatSizeBytes;
+        }
+        bool written = true;
+        for (int copy = 0; copy < image->numFATs; copy++) {
+            off_t fatOffset = ((off_t)image->rsvSecCnt + (off_t)copy * image->secpFAT) * image->BpSect;
+            ssize_t bytesWritten = imageWrite((char *)fatTable + start, end - start, fatOffset + start);
+            if (bytesWritten != (ssize_t)(end - start)) {
+                perror("Error writing FAT");
+                written = false;
+            }
+        }
+        // pages that did not reach every copy stay dirty for the next flush
+        if (!written) {
+            ok = false;
+            continue;
+        }
+        for (uint32_t p = runStart; p < page; p++) {
+            fatDirtyPages[p / 8] &= ~(1 << (p % 8));
+            fatDirtyCount--;
+        }
+    }
+    return ok;
+}
+
+void freeFATTable() {
+    // Releases the FAT cache without writing it back
+    free(fatTable);
+    free(fatDirtyPages);
+    fatTable = NULL;
+    fatDirtyPages = NULL;
+    fatDirtyCount = 0;
+}
+
+bool syncImage() {
+    // sync command, writes all cached data and metadata back to the image
+    if (!flush_write_buffers()) {
+        printf("Error: Failed to write back buffered file data.\n");
+        return false;
+    }
+    if (!flushBufferCache()) {
+        printf("Error: Failed to write back cached clusters.\n");
+        return false;
+    }
+    if (!flushFATTable()) {
+        printf("Error: Failed to write back the FAT.\n");
+        return false;
+    }
+    return writeFSInfo() && imageSync();
+}
+
+
+int is_valid_name(uint8_t *name) {
+    return 1;
+}
+
+uint32_t getNextCluster(uint32_t currentCluster) {
+    // Finds the next cluster based on the current cluster
+    uint32_t next_clus_num = 0;
+
+    if (currentCluster >= 2 && currentCluster < image->entpFAT) {
+        next_clus_num = fatTable[currentCluster] & FAT_ENTRY_MASK;
+        //check for the end of the chain
+	if (next_clus_num >= FAT_EOC_MIN) {
+	    return 0; 
+	}
+    }
+    return next_clus_num;
+}
+
+void canonicalEntryName(const char *name, char *out) {
+    // Pads a name to the 11 byte entry field, anything after the first NUL becomes a space
+    bool ended = false;
+    for (int j = 0; j < 11; j++) {
+        if (!ended && name[j] == '\0') {
+            ended = true;
+        }
+        out[j] = ended ? ' ' : name[j];
+    }
+}
+
+bool checkEntryName(const char *name) {
+    // New entries take the name as typed, so it has to fit the 11 byte field
+    // and may not hold a path or a character FAT forbids in short names
+    if (name[0] == '\0' || name[0] == '.' || name[0] == ' ') {
+        printf("Error: '%s' is not a valid name.\n", name);
+        return false;
+    }
+    if (strlen(name) > 11) {
+        printf("Error: Name '%s' is too long.\n", name);
+        return false;
+    }
+    for (const char *c = name; *c != '\0'; c++) {
+        if ((uint8_t)*c < 0x20 || strchr("\"*+,/:;<=>?\\[]|", *c) != NULL) {
+            printf("Error: Name '%s' cannot contain '%c'.\n", name, *c);
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t hashEntryName(const char *canonical) {
+    // FNV-1a over the padded 11 byte name
+    uint32_t hash = 2166136261u;
+    for (int j = 0; j < 11; j++) {
+        hash = (hash ^ (uint8_t)canonical[j]) * 16777619u;
+    }
+    return hash;
+}
+
+bool isIndexedEntry(directoryEntry *entry) {
+    // Free and deleted slots never need to be found by name
+    return entry->DIR_Name[0] != 0x00 && (uint8_t)entry->DIR_Name[0] != 0xE5;
+}
+
+void indexInsert(dirCacheNode *node, int32_t i) {
+    // Adds entry i to the name index of its directory
+    char key[11];
+    canonicalEntryName(node->entries[i].DIR_Name, key);
+    uint32_t mask = node->indexSize - 1;
+    uint32_t slot = hashEntryName(key) & mask;
+    while (node->index[slot] >= 0) {
+        slot = (slot + 1) & mask;
+    }
+    if (node->index[slot] == DIR_INDEX_DELETED) {
+        node->indexDeleted--;
+    }
+    node->index[slot] = i;
+}
+
+void indexRemove(dirCacheNode *node, int32_t i) {
+    // Removes entry i from the name index, leaving a tombstone so probes keep going
+    char key[11];
+    canonicalEntryName(node->entries[i].DIR_Name, key);
+    uint32_t mask = node->indexSize - 1;
+    uint32_t slot = hashEntryName(key) & mask;
+    while (node->index[slot] != DIR_INDEX_EMPTY) {
+        if (node->index[slot] == i) {
+            node->index[slot] = DIR_INDEX_DELETED;
+            node->indexDeleted++;
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
+
+void buildDirectoryIndex(dirCacheNode *node) {
+    // Hashes every named entry of a large directory, the table is kept at most half full
+    free(node->index);
+    node->index = NULL;
+    node->indexSize = 0;
+    node->indexDeleted = 0;
+    if (node->numEntries < DIR_INDEX_MIN_ENTRIES) {
+        return;
+    }
+    uint32_t size = 1;
+    while (size < (uint32_t)node->numEntries * 2) {
+        size <<= 1;
+    }
+    node->index = malloc(size * sizeof(int32_t));
+    if (node->index == NULL) {
+        return;
+    }
+    node->indexSize = size;
+    memset(node->index, 0xFF, size * sizeof(int32_t)); // every slot DIR_INDEX_EMPTY
+    for (int32_t i = 0; i < node->numEntries; i++) {
+        if (isIndexedEntry(&node->entries[i])) {
+            indexInsert(node, i);
+        }
+    }
+}
+
+void buildOffsetIndex(dirCacheNode *node) {
+    // Hashes the image offset of every entry of a large directory, offsets never change
+    // while the node is cached so the table needs no tombstones
+    free(node->offsetIndex);
+    node->offsetIndex = NULL;
+    node->offsetIndexSize = 0;
+    if (node->numEntries < DIR_INDEX_MIN_ENTRIES) {
+        return;
+    }
+    uint32_t size = 1;
+    while (size < (uint32_t)node->numEntries * 2) {
+        size <<= 1;
+    }
+    node->offsetIndex = malloc(size * sizeof(int32_t));
+    if (node->offsetIndex == NULL) {
+        return;
+    }
+    node->offsetIndexSize = size;
+    memset(node->offsetIndex, 0xFF, size * sizeof(int32_t)); // every slot DIR_INDEX_EMPTY
+    for (int32_t i = 0; i < node->numEntries; i++) {
+        uint32_t slot = (uint32_t)(node->offsets[i] / sizeof(directoryEntry)) * 2654435761u & (size - 1);
+        while (node->offsetIndex[slot] != DIR_INDEX_EMPTY) {
+            slot = (slot + 1) & (size - 1);
+        }
+        node->offsetIndex[slot] = i;
+    }
+}
+
+int findEntryAtOffset(dirCacheNode *node, off_t offset) {
+    // Returns the number of the entry stored at an image offset, or -1
+    if (node->offsetIndex == NULL) {
+        for (int i = 0; i < node->numEntries; i++) {
+            if (node->offsets[i] == offset) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    uint32_t mask = node->offsetIndexSize - 1;
+    uint32_t slot = (uint32_t)(offset / sizeof(directoryEntry)) * 2654435761u & mask;
+    while (node->offsetIndex[slot] != DIR_INDEX_EMPTY) {
+        if (node->offsets[node->offsetIndex[slot]] == offset) {
+            return node->offsetIndex[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+int findEntryIndex(dirCacheNode *node, const char *name) {
+    // Returns the number of the first entry called name, or -1
+    if (node == NULL) {
+        return -1;
+    }
+    if (node->index == NULL) {
+        for (int i = 0; i < node->numEntries; i++) {
+            if (compareDirectoryEntryName(node->entries[i].DIR_Name, name)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    char key[11], other[11];
+    canonicalEntryName(name, key);
+    uint32_t mask = node->indexSize - 1;
+    uint32_t slot = hashEntryName(key) & mask;
+    int found = -1;
+    // duplicates share a probe sequence, keep the lowest entry like the linear scan
+    while (node->index[slot] != DIR_INDEX_EMPTY) {
+        int32_t i = node->index[slot];
+        if (i >= 0 && (found < 0 || i < found)) {
+            canonicalEntryName(node->entries[i].DIR_Name, other);
+            if (memcmp(key, other, 11) == 0) {
+                found = i;
+            }
+        }
+        slot = (slot + 1) & mask;
+    }
+    return found;
+}
+
+dirCacheNode *lookupDirectoryCache(uint32_t directoryCluster) {
+    // Returns the cached node of a directory, or NULL
+    for (dirCacheNode *node = dirCacheBuckets[directoryCluster % DIR_CACHE_BUCKETS]; node != NULL; node = node->hashNext) {
+        if (node->cluster == directoryCluster) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+void unlinkDirectoryCacheNode(dirCacheNode *node) {
+    // Takes a node out of the LRU list
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        dirCacheHead = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    } else {
+        dirCacheTail = node->prev;
+    }
+    node->prev = node->next = NULL;
+}
+
+void removeDirectoryCacheNode(dirCacheNode *node) {
+    // Drops a node from the cache and frees it
+    dirCacheNode **link = &dirCacheBuckets[node->cluster % DIR_CACHE_BUCKETS];
+    while (*link != node) {
+        link = &(*link)->hashNext;
+    }
+    *link = node->hashNext;
+    unlinkDirectoryCacheNode(node);
+    dirCacheBytes -= node->bytes;
+    if (directoryEntries == node->entries) {
+        directoryEntries = NULL;
+        numDirectoryEntries = 0;
+    }
+    if (currentDirectoryNode == node) {
+        currentDirectoryNode = NULL;
+    }
+    free(node->index);
+    free(node->offsetIndex);
+    free(node->entries);
+    free(node->offsets);
+    free(node);
+}
+
+void invalidateDirectoryCache(uint32_t directoryCluster) {
+    // Forgets a directory so the next access reads it from the image
+    dirCacheNode *node = lookupDirectoryCache(directoryCluster);
+    if (node != NULL) {
+        removeDirectoryCacheNode(node);
+    }
+}
+
+void freeDirectoryCache() {
+    // Empties the whole directory cache
+    while (dirCacheHead != NULL) {
+        removeDirectoryCacheNode(dirCacheHead);
+    }
+}
+
+dirCacheNode *readDirectory(uint32_t clusterNumber) {
+    // Reads and parses a whole directory chain into a new cache node
+    uint32_t clusterSize = image->sectpClus * image->BpSect;
+    uint32_t entriesPerCluster = clusterSize / sizeof(directoryEntry);
+
+    //size the entry arrays for the whole chain up front
+    uint32_t chainLength = 0;
+    for (uint32_t c = clusterNumber; c >= 2; c = getNextCluster(c)) {
+        chainLength++;
+    }
+    dirCacheNode *node = calloc(1, sizeof(dirCacheNode));
+    if (node == NULL) {
+        perror("Error allocating memory for directory entries");
+        return NULL;
+    }
+    node->cluster = clusterNumber;
+    if (chainLength > 0) {
+        node->entries = malloc(chainLength * entriesPerCluster * sizeof(directoryEntry));
+        node->offsets = malloc(chainLength * entriesPerCluster * sizeof(off_t));
+        if (node->entries == NULL || node->offsets == NULL) {
+            perror("Error allocating memory for directory entries");
+            free(node->entries);
+            free(node->offsets);
+            free(node);
+            return NULL;
+        }
+    }
+
+    //split the chain into runs of contiguous clusters and load all of them in one batch
+    uint32_t *runStarts = malloc((chainLength > 0 ? chainLength : 1) * sizeof(uint32_t));
+    uint32_t *runLengths = malloc((chainLength > 0 ? chainLength : 1) * sizeof(uint32_t));
+    int numRuns = 0;
+    if (runStarts == NULL || runLengths == NULL) {
+        perror("Error allocating memory for directory runs");
+        chainLength = 0;
+    }
+    for (uint32_t c = (chainLength > 0) ? clusterNumber : 0; c >= 2; c = getNextCluster(c)) {
+        if (numRuns > 0 && runStarts[numRuns - 1] + runLengths[numRuns - 1] == c) {
+            runLengths[numRuns - 1]++;
+        } else {
+            runStarts[numRuns] = c;
+            runLengths[numRuns++] = 1;
+        }
+    }
+    if (numRuns > 0 && !bufferCacheFillRuns(runStarts, runLengths, numRuns)) {
+        fprintf(stderr, "Error: Failed to read directory cluster %" PRIu32 "\n", clusterNumber);
+        numRuns = 0;
+    }
+
+    //parse the cached clusters run by run
+    for (int r = 0; r < numRuns; r++) {
+        for (uint32_t c = runStarts[r]; c < runStarts[r] + runLengths[r]; c++) {
+            off_t clusterOffset = convert_cluster_to_offset(c);
+            char *data = bufferCacheGet(c, true);
+            if (data == NULL) {
+                break;
+            }
+            directoryEntry *entry = (directoryEntry *)data;
+            for (uint32_t i = 0; i < entriesPerCluster; i++, entry++) {
+                if (entry->DIR_Attr == 0x0F) { //skip long file entries
+                    continue;
+                }
+                //check if the entry is a valid file name
+                if (is_valid_name(entry->DIR_Name)) {
+                    node->offsets[node->numEntries] = clusterOffset + (off_t)i * sizeof(directoryEntry);
+                    node->entries[node->numEntries++] = *entry;
+                }
+            }
+            bufferCacheRelease(c, false);
+        }
+    }
+    free(runStarts);
+    free(runLengths);
+
+    //give back the slack of the up front allocation
+    if (node->numEntries > 0) {
+        directoryEntry *entries = realloc(node->entries, node->numEntries * sizeof(directoryEntry));
+        off_t *offsets = realloc(node->offsets, node->numEntries * sizeof(off_t));
+        if (entries != NULL) {
+            node->entries = entries;
+        }
+        if (offsets != NULL) {
+            node->offsets = offsets;
+        }
+    }
+    buildDirectoryIndex(node);
+    buildOffsetIndex(node);
+    node->bytes = sizeof(dirCacheNode) + node->numEntries * (sizeof(directoryEntry) + sizeof(off_t))
+        + (node->indexSize + node->offsetIndexSize) * sizeof(int32_t);
+    return node;
+}
+
+dirCacheNode *getDirectory(uint32_t directoryCluster) {
+    // Returns the parsed entries of a directory, from the cache when possible
+    dirCacheNode *node = lookupDirectoryCache(directoryCluster);
+    if (node != NULL) {
+        unlinkDirectoryCacheNode(node);
+    } else {
+        node = readDirectory(directoryCluster);
+        if (node == NULL) {
+            return NULL;
+        }
+        node->hashNext = dirCacheBuckets[directoryCluster % DIR_CACHE_BUCKETS];
+        dirCacheBuckets[directoryCluster % DIR_CACHE_BUCKETS] = node;
+        dirCacheBytes += node->bytes;
+    }
+    //move to the front of the LRU list
+    node->next = dirCacheHead;
+    if (dirCacheHead != NULL) {
+        dirCacheHead->prev = node;
+    }
+    dirCacheHead = node;
+    if (dirCacheTail == NULL) {
+        dirCacheTail = node;
+    }
+    //evict least recently used directories, always keeping the one just loaded
+    while (dirCacheBytes > dirCacheBudget && dirCacheTail != node) {
+        removeDirectoryCacheNode(dirCacheTail);
+    }
+    return node;
+}
+
+void loadDirectoryEntries(uint32_t clusterNumber) {
+    // Points the global entry list at the entries of a directory
+    dirCacheNode *node = getDirectory(clusterNumber);
+    currentDirectoryNode = node;
+    if (node == NULL) {
+        directoryEntries = NULL;
+        numDirectoryEntries = 0;
+        return;
+    }
+    directoryEntries = node->entries;
+    numDirectoryEntries = node->numEntries;
+}
+
+bool writeDirectoryEntry(uint32_t directoryCluster, off_t offset, directoryEntry *entry) {
+    // Writes one directory entry and patches the cached copy of its directory
+    directoryEntry copy = *entry;
+    bool written = bufferCacheWrite(&copy, sizeof(directoryEntry), offset) == sizeof(directoryEntry);
+    char name[12];
+    memcpy(name, copy.DIR_Name, 11);
+    name[11] = '\0';
+    invalidatePathCache(directoryCluster, name);
+    dirCacheNode *node = lookupDirectoryCache(directoryCluster);
+    if (node != NULL) {
+        int i = findEntryAtOffset(node, offset);
+        if (i < 0) {
+            i = node->numEntries;
+        }
+        if (i < node->numEntries) {
+            // the name that used to live in this slot may have been looked up too
+            memcpy(name, node->entries[i].DIR_Name, 11);
+            invalidatePathCache(directoryCluster, name);
+        }
+        if (written && i < node->numEntries && copy.DIR_Attr != 0x0F) {
+            // keep the name index in step with the patched entry
+            if (node->index != NULL && isIndexedEntry(&node->entries[i])) {
+                indexRemove(node, i);
+            }
+            node->entries[i] = copy;
+            if (node->index != NULL && isIndexedEntry(&node->entries[i])) {
+                indexInsert(node, i);
+            }
+            if (node->indexDeleted > node->indexSize / 4) {
+                buildDirectoryIndex(node);
+            }
+            if (!isIndexedEntry(&node->entries[i]) && i < node->freeHint) {
+                node->freeHint = i;
+            }
+        } else {
+            removeDirectoryCacheNode(node);
+        }
+    }
+    if (!written) {
+        printf("Error: Failed to write directory entry.\n");
+    }
+    return written;
+}
+
+bool appendDirectoryCluster(dirCacheNode *node, uint32_t cluster) {
+    // Adds the entries of a zeroed cluster linked to the end of a cached directory,
+    // the indexes are rebuilt only when they would pass half full
+    uint32_t entriesPerCluster = image->sectpClus * image->BpSect / sizeof(directoryEntry);
+    int numEntries = node->numEntries + entriesPerCluster;
+    bool current = directoryEntries == node->entries;
+    directoryEntry *entries = realloc(node->entries, numEntries * sizeof(directoryEntry));
+    if (entries != NULL) {
+        node->entries = entries;
+    }
+    off_t *offsets = realloc(node->offsets, numEntries * sizeof(off_t));
+    if (offsets != NULL) {
+        node->offsets = offsets;
+    }
+    if (entries == NULL || offsets == NULL) {
+        return false;
+    }
+    off_t clusterOffset = convert_cluster_to_offset(cluster);
+    memset(&node->entries[node->numEntries], 0, entriesPerCluster * sizeof(directoryEntry));
+    for (uint32_t i = 0; i < entriesPerCluster; i++) {
+        node->offsets[node->numEntries + i] = clusterOffset + (off_t)i * sizeof(directoryEntry);
+    }
+    int first = node->numEntries;
+    node->numEntries = numEntries;
+    if (node->indexSize < (uint32_t)numEntries * 2) {
+        buildDirectoryIndex(node);
+    }
+    if (node->offsetIndexSize < (uint32_t)numEntries * 2) {
+        buildOffsetIndex(node);
+    } else {
+        uint32_t mask = node->offsetIndexSize - 1;
+        for (int32_t i = first; i < numEntries; i++) {
+            uint32_t slot = (uint32_t)(node->offsets[i] / sizeof(directoryEntry)) * 2654435761u & mask;
+            while (node->offsetIndex[slot] != DIR_INDEX_EMPTY) {
+                slot = (slot + 1) & mask;
+            }
+            node->offsetIndex[slot] = i;
+        }
+    }
+    if (current) {
+        directoryEntries = node->entries;
+        numDirectoryEntries = node->numEntries;
+    }
+    dirCacheBytes -= node->bytes;
+    node->bytes = sizeof(dirCacheNode) + node->numEntries * (sizeof(directoryEntry) + sizeof(off_t))
+        + (node->indexSize + node->offsetIndexSize) * sizeof(int32_t);
+    dirCacheBytes += node->bytes;
+    return true;
+}
+
+off_t findFreeDirectorySlot(uint32_t directoryCluster) {
+    // Returns the offset of a free entry in a directory, growing the directory by a cluster if full
+    dirCacheNode *node = getDirectory(directoryCluster);
+    if (node == NULL) {
+        return 0;
+    }
+    // slots below the hint are known to be in use, so filling a directory stays linear
+    for (int i = node->freeHint; i < node->numEntries; i++) {
+        uint8_t first = (uint8_t)node->entries[i].DIR_Name[0];
+        if (first == 0x00 || first == 0xE5) {
+            node->freeHint = i;
+            return node->offsets[i];
+        }
+    }
+    node->freeHint = node->numEntries;
+
+    //no free entry left, link a zeroed cluster to the end of the chain
+    uint32_t last = directoryCluster;
+    for (uint32_t c = getNextCluster(last); c >= 2; c = getNextCluster(c)) {
+        last = c;
+    }
+    uint32_t newCluster = extendClusterChain(last, 1);
+    if (newCluster == 0) {
+        return 0;
+    }
+    uint32_t clusterSize = image->sectpClus * image->BpSect;
+    char *data = bufferCacheGet(newCluster, false);
+    if (data == NULL) {
+        invalidateDirectoryCache(directoryCluster);
+        printf("Error: Failed to clear directory cluster.\n");
+        return 0;
+    }
+    memset(data, 0, clusterSize);
+    bufferCacheRelease(newCluster, true);
+    if (!appendDirectoryCluster(node, newCluster)) {
+        invalidateDirectoryCache(directoryCluster);
+    }
+    return convert_cluster_to_offset(newCluster);
+}
+
+bool listDirectoryEntries(const char *path) {
+    
+    //compute the cluster number for the specified directory path
+    uint32_t currentCluster = getClusterNumber(path);
+    if (currentCluster == 0) {
+        return false;
+    }
+    //store the directory entries in global list
     loadDirectoryEntries(currentCluster);
 
-    //print directory entries from the global variable
-    for (int i = 0; i < numDirectoryEntries; i++) {
-	char name[11];
-	memcpy(name, directoryEntries[i].DIR_Name, 11);
-	name[11] = '\0'; 
-	if ((name[0] == 0x00 || name[0] == 0x20) || name[0] == 0xE5){
-		continue;
-	}
-	printf("%s\n", name);
+    //print directory entries from the global variable
+    for (int i = 0; i < numDirectoryEntries; i++) {
+	char name[12];
+	memcpy(name, directoryEntries[i].DIR_Name, 11);
+	name[11] = '\0'; 
+	if ((name[0] == 0x00 || name[0] == 0x20) || (uint8_t)name[0] == 0xE5){
+		continue;
+	}
+	printf("%s\n", name);
+    }
+    return true;
+}
+
+bool open_file_for_read(const char* filename, const char* flags) {
+    // Opens files for reading and/or writing
+    uint8_t mode;
+    if (strcmp(flags, "-r") == 0) {
+	mode = MODE_READ;
+    } else if (strcmp(flags, "-w") == 0) {
+	mode = MODE_WRITE;
+    } else if (strcmp(flags, "-rw") == 0 || strcmp(flags, "-wr") == 0) {
+	mode = MODE_READ | MODE_WRITE;
+    } else {
+	printf("Error: Invalid mode '%s', use -r, -w, -rw or -wr.\n", flags);
+	return false;
+    }
+
+    loadDirectoryEntries(currentClusterNumber);
+    directoryEntry* file_entry = find_file_in_directory(filename);
+    
+    if (file_entry == NULL) {
+	printf("Error: File '%s' not found.\n", filename);
+	return false;
+    }
+
+    // Makes sure a file is not already opened	
+    for (int i = 0; i < numOpenedFiles; ++i) {
+	if (strcmp(opened_files[i].name, filename) == 0 && opened_files[i].is_open) {
+	    printf("Error: File '%s' is already open.\n", filename);
+	    return false;
+	}
+    }
+
+    // Initializes a new opened file	
+    open_file new_file;
+    memset(&new_file, 0, sizeof(open_file));
+    strncpy(new_file.name, filename, 11);
+    new_file.is_open = 1;
+    new_file.start_cluster = (file_entry->DIR_FstClusHI << 16) | file_entry->DIR_FstClusLO;
+    new_file.size = file_entry->DIR_FileSize;
+    new_file.offset = 0;
+    new_file.access_mode = mode;
+    new_file.dir_cluster = currentClusterNumber;
+    strncpy(new_file.path, currentDirectory != NULL ? currentDirectory : "", sizeof(new_file.path) - 1);
+
+    // Make updates to opened files array	
+    opened_files = realloc(opened_files, (numOpenedFiles + 1) * sizeof(open_file));
+    opened_files[numOpenedFiles] = new_file;
+    numOpenedFiles++;
+    return true;
+}
+
+bool closeFile(const char* filename) {
+    //check to see if file exists
+    loadDirectoryEntries(currentClusterNumber);
+    directoryEntry* fileEntry = find_file_in_directory(filename);
+    if (fileEntry == NULL) {
+        printf("Error: File '%s' not found.\n", filename);
+        return false;
+    }
+
+    //check if file is open
+    bool fileOpen = false;
+    for (int i = 0; i < numOpenedFiles; ++i) {
+        if (strcmp(opened_files[i].name, filename) == 0 && opened_files[i].is_open) {
+            fileOpen = true;
+            if (!flush_write_buffer(&opened_files[i])) {
+                return false;
+            }
+            invalidate_file_extents(&opened_files[i]);
+            //remove the file entry from the open file list
+            for (int j = i; j < numOpenedFiles - 1; ++j) {
+                opened_files[j] = opened_files[j + 1];
+            }
+            numOpenedFiles--;
+            break;
+        }
+    }
+
+    if (!fileOpen) {
+        printf("Error: File '%s' is not open.\n", filename);
+    }
+    return fileOpen;
+}
+
+bool read_data_from_file(const char *filename, int size) {
+    open_file* file = NULL;
+
+    // Makes sure a file exists and is open for reading	
+    for (int i = 0; i < numOpenedFiles; ++i) {
+	if (strcmp(opened_files[i].name, filename) == 0 && opened_files[i].is_open) {
+	    file = &opened_files[i];
+	    break;
+	}
+    }
+
+    if (file == NULL) {
+	printf("Error: File '%s' not found.\n", filename);
+	return false;
+    }
+
+    if (!(file->access_mode & MODE_READ)) {
+	printf("Error: File '%s' is not opened for reading.\n", filename);
+	return false;
+    }
+
+    // buffered writes have to reach the chain before they can be read back
+    if (!flush_write_buffer(file)) {
+	return false;
+    }
+
+    if (file->offset >= file->size) {
+	return true;
+    }
+
+    if (file->offset + size > file->size) {
+	size = file->size - file->offset;
+    }
+
+    char* buffer = malloc(size);
+    ssize_t bytes_read = 0;
+    if (use_parallel_read(size)) {
+        // Large reads skip the cache and are copied by the worker threads
+        if (!parallel_read_file(file, buffer, file->offset, size)) {
+            free(buffer);
+            return false;
+        }
+        bytes_read = size;
+        file->ra_window = 0;
+        file->ra_end = 0;
+    } else {
+        read_ahead_file(file, size);
+        if (file->ra_window == 0) {
+            // no read-ahead, still fetch every extent of this read in one batch
+            prefetch_file_range(file, file->offset, file->offset + size);
+        }
+    }
+
+    // Read one extent of contiguous clusters per pread
+    while (bytes_read < size) {
+	uint32_t run_bytes;
+	off_t offset = map_file_offset(file, file->offset + bytes_read, &run_bytes);
+	if (offset == 0) {
+	    free(buffer);
+	    return false;
+	}
+	uint32_t chunk = (size - bytes_read < run_bytes) ? size - bytes_read : run_bytes;
+	if (bufferCacheRead(buffer + bytes_read, chunk, offset) != chunk) {
+	    free(buffer);
+	    return false;
+	}
+	bytes_read += chunk;
+    }
+
+    // Print data that was read from file	
+    printf("Data read from file '%s':\n", filename);
+    for (int i = 0; i < size; ++i) {
+	printf("%c", buffer[i]);
+    }
+    printf("\n");
+
+    free(buffer);
+    file->offset += bytes_read;
+    file->ra_next = file->offset;
+    return true;
+}
+
+void read_ahead_file(open_file *file, uint32_t size) {
+    // Grows the window while reads continue where the last one ended and
+    // prefetches the read plus the window, one buffer cache fill per extent
+    uint32_t clusterSize = image->sectpClus * image->BpSect;
+    uint32_t maxWindow = readAheadMax / clusterSize;
+    if (bufferCacheBudget / 4 / clusterSize < maxWindow) {
+        maxWindow = bufferCacheBudget / 4 / clusterSize;
+    }
+    if (file->offset != file->ra_next || maxWindow == 0) {
+        file->ra_window = 0;
+        file->ra_end = 0;
+        return;
+    }
+    if (file->ra_window == 0) {
+        file->ra_window = READ_AHEAD_MIN_CLUSTERS;
+    } else if (file->ra_window < maxWindow) {
+        file->ra_window *= 2;
+    }
+    if (file->ra_window > maxWindow) {
+        file->ra_window = maxWindow;
+    }
+
+    // only refill once the read gets within half a window of what was prefetched
+    uint32_t readEnd = file->offset + size;
+    if (readEnd + file->ra_window / 2 * clusterSize <= file->ra_end) {
+        return;
+    }
+    uint32_t end = readEnd + file->ra_window * clusterSize;
+    if (end > file->size) {
+        end = file->size;
+    }
+    uint32_t pos = (file->ra_end > file->offset) ? file->ra_end : file->offset;
+    file->ra_end = prefetch_file_range(file, pos, end);
+}
+
+bool use_parallel_read(uint32_t size) {
+    // Workers only run when the backend copies without shared state, the
+    // windowed mmap backend moves its windows on every access
+    if (size < PARALLEL_READ_MIN || readThreads < 2) {
+        return false;
+    }
+    return strcmp(imageIO->name, "mmap") != 0 || mmapBase != NULL;
+}
+
+void *parallel_read_worker(void *arg) {
+    // Copies jobs into their own region of the output until the pool is empty
+    readPool *pool = arg;
+    for (;;) {
+        int i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (i >= pool->numJobs || __atomic_load_n(&pool->failed, __ATOMIC_RELAXED)) {
+            break;
+        }
+        readJob *job = &pool->jobs[i];
+        if (imageRead(job->dest, job->len, job->offset) != job->len) {
+            __atomic_store_n(&pool->failed, true, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+bool parallel_read_file(open_file *file, char *buffer, uint32_t pos, uint32_t size) {
+    // Splits [pos, pos + size) into cluster aligned pieces of its extents and
+    // has readThreads workers copy them straight from the image into buffer
+    uint32_t clusterSize = image->sectpClus * image->BpSect;
+    uint32_t piece = size / (readThreads * 4);
+    if (piece < PARALLEL_READ_CHUNK_MIN) {
+        piece = PARALLEL_READ_CHUNK_MIN;
+    }
+    piece = (piece + clusterSize - 1) / clusterSize * clusterSize;
+
+    // dirty clusters would be older on disk than in the cache
+    if (bufferCacheDirty > 0 && !flushBufferCache()) {
+        return false;
+    }
+
+    int maxJobs = size / piece + size / clusterSize + 2;
+    readPool pool = { malloc(maxJobs * sizeof(readJob)), 0, 0, false };
+    if (pool.jobs == NULL) {
+        perror("Error allocating read jobs");
+        return false;
+    }
+    uint32_t done = 0;
+    while (done < size) {
+        uint32_t run_bytes;
+        off_t offset = map_file_offset(file, pos + done, &run_bytes);
+        if (offset == 0) {
+            free(pool.jobs);
+            return false;
+        }
+        uint32_t chunk = (size - done < run_bytes) ? size - done : run_bytes;
+        for (uint32_t at = 0; at < chunk; at += piece) {
+            readJob *job = &pool.jobs[pool.numJobs++];
+            job->dest = buffer + done + at;
+            job->offset = offset + at;
+            job->len = (chunk - at < piece) ? chunk - at : piece;
+        }
+        done += chunk;
+    }
+
+    int numThreads = (readThreads < pool.numJobs) ? readThreads : pool.numJobs;
+    pthread_t *threads = malloc(numThreads * sizeof(pthread_t));
+    int started = 0;
+    while (threads != NULL && started < numThreads) {
+        if (pthread_create(&threads[started], NULL, parallel_read_worker, &pool) != 0) {
+            break;
+        }
+        started++;
+    }
+    // the calling thread helps, and finishes alone if no worker could start
+    parallel_read_worker(&pool);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(pool.jobs);
+    return !pool.failed;
+}
+
+uint32_t prefetch_file_range(open_file *file, uint32_t pos, uint32_t end) {
+    // Collects the extents covering [pos, end) and loads them with one batched
+    // buffer cache fill, returns how far the range was mapped
+    uint32_t clusterSize = image->sectpClus * image->BpSect;
+    uint32_t maxRuns = (end > pos) ? (end - pos) / clusterSize + 2 : 1;
+    uint32_t *runStarts = malloc(maxRuns * sizeof(uint32_t));
+    uint32_t *runLengths = malloc(maxRuns * sizeof(uint32_t));
+    if (runStarts == NULL || runLengths == NULL) {
+        free(runStarts);
+        free(runLengths);
+        return pos;
+    }
+    uint32_t start = pos;
+    int numRuns = 0;
+    while (pos < end && numRuns < maxRuns) {
+        uint32_t run_bytes;
+        off_t offset = map_file_offset(file, pos, &run_bytes);
+        if (offset == 0) {
+            break;
+        }
+        uint32_t chunk = (end - pos < run_bytes) ? end - pos : run_bytes;
+        uint32_t within = (offset - image->dataStartOffset) % clusterSize;
+        runStarts[numRuns] = (offset - image->dataStartOffset) / clusterSize + 2;
+        runLengths[numRuns++] = (within + chunk + clusterSize - 1) / clusterSize;
+        pos += chunk;
+    }
+    if (numRuns > 0 && !bufferCacheFillRuns(runStarts, runLengths, numRuns)) {
+        pos = start;
+    }
+    free(runStarts);
+    free(runLengths);
+    return pos;
+}
+
+bool export_file(const char *filename, const char *hostpath) {
+    // cat and export commands, stream a file extent by extent from the image
+    // to stdout or a host file without copying it through the shell
+    loadDirectoryEntries(currentClusterNumber);
+    directoryEntry *entry = find_file_in_directory(filename);
+    if (entry == NULL) {
+	printf("Error: File '%s' not found.\n", filename);
+	return false;
+    }
+    if (entry->DIR_Attr & ATTR_DIRECTORY) {
+	printf("Error: '%s' is a directory.\n", filename);
+	return false;
+    }
+
+    int outFd = STDOUT_FILENO;
+    if (hostpath != NULL) {
+	outFd = open(hostpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (outFd < 0) {
+	    printf("Error: Cannot open '%s': %s\n", hostpath, strerror(errno));
+	    return false;
+	}
+    } else {
+	fflush(stdout);
+    }
+
+    // a temporary handle gives the extent list of the chain
+    open_file file;
+    memset(&file, 0, sizeof(file));
+    file.start_cluster = (entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+    file.size = entry->DIR_FileSize;
+    bool ok = true;
+    uint32_t done = 0;
+    while (ok && done < file.size) {
+	uint32_t run_bytes;
+	off_t offset = map_file_offset(&file, done, &run_bytes);
+	if (offset == 0) {
+	    printf("Error: Cluster chain of '%s' is shorter than its size.\n", filename);
+	    ok = false;
+	    break;
+	}
+	uint32_t chunk = (file.size - done < run_bytes) ? file.size - done : run_bytes;
+	ok = copy_fd_range(image->fd, &offset, outFd, NULL, chunk);
+	done += chunk;
+    }
+    invalidate_file_extents(&file);
+
+    if (hostpath != NULL) {
+	if (close(outFd) != 0) {
+	    ok = false;
+	}
+	if (!ok) {
+	    printf("Error: Failed to export '%s' to '%s'.\n", filename, hostpath);
+	}
+    } else {
+	// like read, end the output with a newline so the prompt starts on its own line
+	printf("\n");
+    }
+    return ok;
+}
+
+bool copy_fd_range(int inFd, off_t *inOffset, int outFd, off_t *outOffset, size_t len) {
+    // Copies len bytes between two files in the kernel: copy_file_range into regular
+    // files, sendfile into anything else, a buffer when neither works. A NULL offset
+    // uses and moves the file position like read and write do
+    if (image != NULL && (inFd == image->fd || outFd == image->fd)
+        && bufferCacheDirty > 0 && !flushBufferCache()) {
+	// the kernel goes to the image file, so cached clusters have to be there first
+	printf("Error: Failed to write back cached clusters.\n");
+	return false;
+    }
+    struct stat st;
+    bool tryCopyRange = fstat(outFd, &st) == 0 && S_ISREG(st.st_mode);
+    bool trySendfile = outOffset == NULL;
+    while (len > 0) {
+	ssize_t n;
+	if (tryCopyRange) {
+	    n = copy_file_range(inFd, inOffset, outFd, outOffset, len, 0);
+	    countIO(IO_COPY_RANGE, n);
+	    if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+		tryCopyRange = false;
+		continue;
+	    }
+	} else if (trySendfile) {
+	    n = sendfile(outFd, inFd, inOffset, len);
+	    countIO(IO_SENDFILE, n);
+	    if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+		trySendfile = false;
+		continue;
+	    }
+	} else {
+	    static char buffer[HOST_COPY_BUFFER_SIZE];
+	    size_t want = (len < sizeof(buffer)) ? len : sizeof(buffer);
+	    n = (inOffset != NULL) ? pread(inFd, buffer, want, *inOffset) : read(inFd, buffer, want);
+	    if (image != NULL && inFd == image->fd) {
+		countIO(IO_PREAD, n);
+	    }
+	    for (ssize_t written = 0; n > 0 && written < n; ) {
+		ssize_t w = (outOffset != NULL) ? pwrite(outFd, buffer + written, n - written, *outOffset + written)
+		    : write(outFd, buffer + written, n - written);
+		if (image != NULL && outFd == image->fd) {
+		    countIO(IO_PWRITE, w);
+		}
+		if (w < 0 && errno == EINTR) {
+		    continue;
+		}
+		if (w <= 0) {
+		    return false;
+		}
+		written += w;
+	    }
+	    if (n > 0 && inOffset != NULL) {
+		*inOffset += n;
+	    }
+	    if (n > 0 && outOffset != NULL) {
+		*outOffset += n;
+	    }
+	}
+	if (n < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (n <= 0) {
+	    // the source ended early, a host file may have shrunk while it was copied
+	    return false;
+	}
+	len -= n;
+    }
+    return true;
+}
+
+bool import_file(const char *hostpath, const char *filename) {
+    // import command, creates a file in the current directory from a host file,
+    // the chain is allocated for the whole size up front and the entry written once
+    int inFd = open(hostpath, O_RDONLY);
+    if (inFd < 0) {
+	printf("Error: Cannot open '%s': %s\n", hostpath, strerror(errno));
+	return false;
+    }
+    struct stat st;
+    if (fstat(inFd, &st) != 0 || !S_ISREG(st.st_mode)) {
+	printf("Error: '%s' is not a regular file.\n", hostpath);
+	close(inFd);
+	return false;
+    }
+    if (st.st_size > UINT32_MAX) {
+	printf("Error: '%s' is larger than the 4 GB FAT32 file limit.\n", hostpath);
+	close(inFd);
+	return false;
+    }
+    uint32_t size = (uint32_t)st.st_size;
+    open_file file;
+    if (!create_sized_file(currentClusterNumber, filename, size, &file)) {
+	close(inFd);
+	return false;
+    }
+    bool ok = true;
+    uint32_t done = 0;
+    while (ok && done < size) {
+	uint32_t run_bytes;
+	off_t offset = map_file_offset(&file, done, &run_bytes);
+	uint32_t chunk = (size - done < run_bytes) ? size - done : run_bytes;
+	ok = offset != 0 && copy_fd_range(inFd, NULL, image->fd, &offset, chunk);
+	done += chunk;
+    }
+    close(inFd);
+    invalidate_file_extents(&file);
+
+    if (ok) {
+	return updateFileEntry(currentClusterNumber, filename, file.start_cluster, size);
+    }
+    printf("Error: Failed to import '%s'.\n", hostpath);
+    discard_new_file(currentClusterNumber, filename, file.start_cluster);
+    return false;
+}
+
+bool create_sized_file(uint32_t directoryCluster, const char *filename, uint32_t size, open_file *file) {
+    // Creates an entry in a directory and allocates a chain for size bytes in one go,
+    // file is a temporary handle with the extents of the new chain
+    if (!createFileInDirectory(directoryCluster, filename)) {
+	return false;
+    }
+    uint32_t clusterSize = image->sectpClus * image->BpSect;
+    memset(file, 0, sizeof(*file));
+    strncpy(file->name, filename, 11);
+    file->dir_cluster = directoryCluster;
+    file->size = size;
+    file->extents_valid = 1;
+    if (!ensure_file_clusters(file, (size + clusterSize - 1) / clusterSize)) {
+	invalidate_file_extents(file);
+	removeEntry(directoryCluster, filename);
+	return false;
+    }
+    // the clusters are written behind the buffer cache, forget stale copies of them
+    for (uint32_t i = 0; i < file->num_extents; i++) {
+	bufferCacheInvalidate(file->extents[i].start_cluster, file->extents[i].count);
+    }
+    return true;
+}
+
+void discard_new_file(uint32_t directoryCluster, const char *filename, uint32_t startCluster) {
+    // Gives the chain of a half made file back and drops its entry
+    for (uint32_t c = startCluster; c >= 2; ) {
+	uint32_t next = getNextCluster(c);
+	releaseCluster(c);
+	c = next;
+    }
+    removeEntry(directoryCluster, filename);
+}
+
+bool copyFile(const char *source, const char *destination) {
+    // cp command, copies a file of the current directory to a new one, the destination
+    // is resolved like mv's; the new chain is allocated up front and the data is
+    // copied inside the image by the kernel
+    loadDirectoryEntries(currentClusterNumber);
+    directoryEntry *entry = find_file_in_directory(source);
+    if (entry == NULL) {
+	printf("Error: File '%s' not found.\n", source);
+	return false;
+    }
+    if (entry->DIR_Attr & ATTR_DIRECTORY) {
+	printf("Error: '%s' is a directory.\n", source);
+	return false;
+    }
+    open_file src;
+    memset(&src, 0, sizeof(src));
+    src.start_cluster = (entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+    src.size = entry->DIR_FileSize;
+
+    uint32_t targetCluster;
+    char newName[256];
+    if (!resolveDestination(destination, source, &targetCluster, newName)) {
+	return false;
+    }
+    open_file dst;
+    if (!create_sized_file(targetCluster, newName, src.size, &dst)) {
+	return false;
+    }
+
+    // each step copies up to the end of the shorter of the two current extents
+    bool ok = true;
+    uint32_t done = 0;
+    while (ok && done < src.size) {
+	uint32_t src_run, dst_run;
+	off_t srcOffset = map_file_offset(&src, done, &src_run);
+	off_t dstOffset = map_file_offset(&dst, done, &dst_run);
+	if (srcOffset == 0 || dstOffset == 0) {
+	    ok = false;
+	    break;
+	}
+	uint32_t chunk = src.size - done;
+	if (src_run < chunk) {
+	    chunk = src_run;
+	}
+	if (dst_run < chunk) {
+	    chunk = dst_run;
+	}
+	ok = copy_fd_range(image->fd, &srcOffset, image->fd, &dstOffset, chunk);
+	done += chunk;
+    }
+    invalidate_file_extents(&src);
+    invalidate_file_extents(&dst);
+
+    if (ok) {
+	return updateFileEntry(targetCluster, newName, dst.start_cluster, src.size);
+    }
+    printf("Error: Failed to copy '%s' to '%s'.\n", source, destination);
+    discard_new_file(targetCluster, newName, dst.start_cluster);
+    return false;
+}
+
+bool write_data_to_file(const char *filename, const char *data) {
+    // Checks to make sure if file exists or is open
+    open_file *file = NULL;
+    for (int i = 0; i < numOpenedFiles; i++) {
+	if (strcmp(opened_files[i].name, filename) == 0 && opened_files[i].is_open) {
+	    file = &opened_files[i];
+	    break;
+	}
+    }
+    
+    if (file == NULL) {
+	printf("Error: File '%s' not found or not opened.\n", filename);
+	return false;
+    }
+
+    // Check that the file is not read only	
+    if (!(file->access_mode & MODE_WRITE)) {
+	printf("Error: File '%s' is not write accessible.\n", filename);
+	return false;
+    }
+
+    uint32_t dataLength = strlen(data);
+    if (dataLength == 0) {
+	return true;
+    }
+
+    // Merge with the buffered range when this write overlaps or continues it
+    uint32_t wb_end = file->wb_start + file->wb_len;
+    bool mergeable = file->wb_len == 0 || (file->offset >= file->wb_start && file->offset <= wb_end);
+    if (!mergeable || (file->offset + dataLength) - (file->wb_len ? file->wb_start : file->offset) > writeBufferMax) {
+	if (!flush_write_buffer(file)) {
+	    return false;
+	}
+    }
+    if (dataLength > writeBufferMax) {
+	// too large to be worth buffering
+	if (!write_file_range(file, data, file->offset, dataLength)) {
+	    return false;
+	}
+    } else {
+	if (file->wb_len == 0) {
+	    file->wb_start = file->offset;
+	    file->wb_disk_size = file->size;
+	}
+	uint32_t need = file->offset + dataLength - file->wb_start;
+	if (need > file->wb_cap) {
+	    uint32_t cap = file->wb_cap ? file->wb_cap : 4096;
+	    while (cap < need) {
+		cap *= 2;
+	    }
+	    if (cap > writeBufferMax) {
+		cap = writeBufferMax;
+	    }
+	    char *grown = realloc(file->wb_data, cap);
+	    if (grown == NULL) {
+		perror("Error allocating write buffer");
+		return false;
+	    }
+	    writeBufferBytes += cap - file->wb_cap;
+	    file->wb_data = grown;
+	    file->wb_cap = cap;
+	}
+	memcpy(file->wb_data + (file->offset - file->wb_start), data, dataLength);
+	if (need > file->wb_len) {
+	    file->wb_len = need;
+	}
+    }
+
+    file->offset += dataLength;
+    if (file->offset > file->size) {
+	file->size = file->offset;
+    }
+    // memory pressure, give every buffered file back to the chain
+    if (writeBufferBytes > WRITE_BUFFER_BUDGET) {
+	return flush_write_buffers();
+    }
+    if (file->wb_len == 0) {
+	return updateFileEntry(file->dir_cluster, file->name, file->start_cluster, file->size);
+    }
+    return true;
+}
+
+bool write_file_range(open_file *file, const char *data, uint32_t dataOffset, uint32_t dataLength) {
+    // Writes data at dataOffset of the file, growing the chain once for the whole range
+    uint32_t clusterSize = image->sectpClus * image->BpSect;
+    uint32_t clustersNeeded = (dataOffset + dataLength + clusterSize - 1) / clusterSize;
+    if (!ensure_file_clusters(file, clustersNeeded)) {
+	return false;
+    }
+
+    // Write one extent of contiguous clusters per pwrite
+    uint32_t remainingBytes = dataLength;
+    while (remainingBytes > 0) {
+	uint32_t run_bytes;
+	off_t clusterOffset = map_file_offset(file, dataOffset, &run_bytes);
+	if (clusterOffset == 0) {
+	    return false;
+	}
+	uint32_t bytesToWrite = (remainingBytes < run_bytes) ? remainingBytes : run_bytes;
+
+	ssize_t bytesWritten = bufferCacheWrite(data, bytesToWrite, clusterOffset);
+
+	if (bytesWritten != bytesToWrite) {
+	    return false;
+	}
+
+	remainingBytes -= bytesWritten;
+	data += bytesWritten;
+	dataOffset += bytesWritten;
+    }
+    return true;
+}
+
+bool flush_write_buffer(open_file *file) {
+    // Gives the buffered range to the chain in one go and updates the entry once
+    if (file->wb_len > 0) {
+	if (!write_file_range(file, file->wb_data, file->wb_start, file->wb_len)) {
+	    // keep the data for the next flush, the size goes back to the one in the entry
+	    // which still gets the chain so newly linked clusters are not lost
+	    file->size = file->wb_disk_size;
+	    updateFileEntry(file->dir_cluster, file->name, file->start_cluster, file->size);
+	    printf("Error: Failed to write back buffered data of '%s'.\n", file->name);
+	    return false;
+	}
+	if (file->wb_start + file->wb_len > file->size) {
+	    file->size = file->wb_start + file->wb_len;
+	}
+	file->wb_len = 0;
+	if (!updateFileEntry(file->dir_cluster, file->name, file->start_cluster, file->size)) {
+	    return false;
+	}
+    }
+    writeBufferBytes -= file->wb_cap;
+    free(file->wb_data);
+    file->wb_data = NULL;
+    file->wb_cap = 0;
+    return true;
+}
+
+bool flush_write_buffers() {
+    // Flushes the write buffers of every open file
+    bool ok = true;
+    for (int i = 0; i < numOpenedFiles; i++) {
+	if (opened_files[i].wb_cap > 0 && !flush_write_buffer(&opened_files[i])) {
+	    ok = false;
+	}
+    }
+    return ok;
+}
+
+bool allocateFile(const char* filename, uint32_t bytes) {
+    // fallocate command, reserves clusters for a file without changing its size
+    loadDirectoryEntries(currentClusterNumber);
+    directoryEntry* file_entry = find_file_in_directory(filename);
+    if (file_entry == NULL) {
+	printf("Error: File '%s' not found.\n", filename);
+	return false;
+    }
+    if (file_entry->DIR_Attr & ATTR_DIRECTORY) {
+	printf("Error: '%s' is a directory.\n", filename);
+	return false;
+    }
+
+    uint32_t clusterSize = image->sectpClus * image->BpSect;
+    uint32_t startCluster = (file_entry->DIR_FstClusHI << 16) | file_entry->DIR_FstClusLO;
+    uint32_t size = file_entry->DIR_FileSize;
+    uint32_t oldStart = startCluster;
+    uint32_t clustersNeeded = (uint32_t)(((uint64_t)bytes + clusterSize - 1) / clusterSize);
+    if (!ensureChainLength(&startCluster, clustersNeeded)) {
+	return false;
+    }
+
+    // keep any open handle of the file pointing at the new chain
+    for (int i = 0; i < numOpenedFiles; ++i) {
+	if (strcmp(opened_files[i].name, filename) == 0 && opened_files[i].dir_cluster == currentClusterNumber) {
+	    opened_files[i].start_cluster = startCluster;
+	    invalidate_file_extents(&opened_files[i]);
+	}
+    }
+    if (startCluster != oldStart) {
+	return updateFileEntry(currentClusterNumber, filename, startCluster, size);
+    }
+    return true;
+}
+
+bool add_file_extent(open_file *file, uint32_t cluster) {
+    // Appends the next cluster of the file to its extent list
+    if (file->num_extents > 0) {
+	file_extent *last = &file->extents[file->num_extents - 1];
+	if (last->start_cluster + last->count == cluster) {
+	    last->count++;
+	    return true;
+	}
+    }
+    if (file->num_extents == file->extent_capacity) {
+	uint32_t capacity = file->extent_capacity ? file->extent_capacity * 2 : 8;
+	file_extent *temp = realloc(file->extents, capacity * sizeof(file_extent));
+	if (temp == NULL) {
+	    perror("Error allocating memory for file extents");
+	    return false;
+	}
+	file->extents = temp;
+	file->extent_capacity = capacity;
+    }
+    file_extent *extent = &file->extents[file->num_extents++];
+    extent->file_cluster = file->num_extents > 1 ? extent[-1].file_cluster + extent[-1].count : 0;
+    extent->start_cluster = cluster;
+    extent->count = 1;
+    return true;
+}
+
+bool load_file_extents(open_file *file) {
+    // Builds the extent list of an opened file from its cluster chain
+    if (file->extents_valid) {
+	return true;
+    }
+    file->num_extents = 0;
+    for (uint32_t c = file->start_cluster; c >= 2; c = getNextCluster(c)) {
+	if (!add_file_extent(file, c)) {
+	    return false;
+	}
+    }
+    file->extents_valid = 1;
+    return true;
+}
+
+void invalidate_file_extents(open_file *file) {
+    // Drops the extent list, it is rebuilt on the next access
+    free(file->extents);
+    file->extents = NULL;
+    file->num_extents = 0;
+    file->extent_capacity = 0;
+    file->extents_valid = 0;
+}
+
+bool ensure_file_clusters(open_file *file, uint32_t count) {
+    // Grows an opened file to count clusters, appending only the new clusters to its extents
+    if (!load_file_extents(file)) {
+	return false;
+    }
+    uint32_t have = 0;
+    uint32_t last = 0;
+    if (file->num_extents > 0) {
+	file_extent *tail = &file->extents[file->num_extents - 1];
+	have = tail->file_cluster + tail->count;
+	last = tail->start_cluster + tail->count - 1;
+    }
+    if (have >= count) {
+	return true;
+    }
+    uint32_t first = extendClusterChain(last, count - have);
+    if (first == 0) {
+	return false;
+    }
+    if (file->start_cluster < 2) {
+	file->start_cluster = first;
+    }
+    for (uint32_t c = first; c >= 2; c = getNextCluster(c)) {
+	if (!add_file_extent(file, c)) {
+	    invalidate_file_extents(file);
+	    return false;
+	}
+    }
+    return true;
+}
+
+off_t map_file_offset(open_file *file, uint32_t offset, uint32_t *run_bytes) {
+    // Maps a byte offset in an opened file to an image offset, 0 if it lies past the chain
+    uint32_t clusterSize = image->sectpClus * image->BpSect;
+    if (!load_file_extents(file) || file->num_extents == 0) {
+	return 0;
+    }
+    uint32_t index = offset / clusterSize;
+
+    // binary search for the last extent starting at or before index
+    uint32_t lo = 0, hi = file->num_extents;
+    while (hi - lo > 1) {
+	uint32_t mid = lo + (hi - lo) / 2;
+	if (file->extents[mid].file_cluster <= index) {
+	    lo = mid;
+	} else {
+	    hi = mid;
+	}
+    }
+    file_extent *extent = &file->extents[lo];
+    if (index >= extent->file_cluster + extent->count) {
+	return 0;
+    }
+    uint32_t clusterInRun = index - extent->file_cluster;
+    uint32_t inCluster = offset % clusterSize;
+    if (run_bytes != NULL) {
+	*run_bytes = (extent->count - clusterInRun) * clusterSize - inCluster;
+    }
+    return convert_cluster_to_offset(extent->start_cluster + clusterInRun) + inCluster;
+}
+
+uint32_t compute_dentry_offset(uint32_t clusterNumber, const char* filename) {
+	// Computes offset of a directory entry
+        dirCacheNode *node = getDirectory(clusterNumber);
+        int i = findEntryIndex(node, filename);
+        if (i >= 0) {
+            return node->offsets[i];
+        }
+        printf("offset not calc");
+        return 0;
+}
+
+bool updateFileEntry(uint32_t directoryCluster, const char *filename, uint32_t startCluster, uint32_t size) {
+    // Rewrites the first cluster and size of a file's directory entry
+    dirCacheNode *node = getDirectory(directoryCluster);
+    int i = findEntryIndex(node, filename);
+    if (i >= 0) {
+        directoryEntry entry = node->entries[i];
+        entry.DIR_FstClusHI = (startCluster >> 16) & 0xFFFF;
+        entry.DIR_FstClusLO = startCluster & 0xFFFF;
+        entry.DIR_FileSize = size;
+        return writeDirectoryEntry(directoryCluster, node->offsets[i], &entry);
+    }
+    printf("Error: File '%s' not found.\n", filename);
+    return false;
+}
+
+bool removeFile(const char *filename) {
+    //check if the file is open
+    for (int i = 0; i < numOpenedFiles; ++i) {
+        if (strcmp(opened_files[i].name, filename) == 0 && opened_files[i].is_open) {
+            printf("Error: File '%s' is open. Please close.\n", filename);
+            return false;
+        }
+    }
+    loadDirectoryEntries(currentClusterNumber);
+    directoryEntry* dentry = find_file_in_directory(filename);
+    if (dentry == NULL) {
+        printf("Error: File '%s' not found.\n", filename);
+        return false;
+    }
+    if (dentry->DIR_Attr & ATTR_DIRECTORY) {
+        printf("Error: '%s' is a directory, use rmdir or rm -r.\n", filename);
+        return false;
+    }
+    return removeEntry(currentClusterNumber, filename);
+}
+
+bool removeEntry(uint32_t directoryCluster, const char *name) {
+    // Marks an entry deleted and frees its cluster chain
+    dirCacheNode *node = getDirectory(directoryCluster);
+    int i = findEntryIndex(node, name);
+    if (i < 0) {
+        printf("Error: File '%s' not found.\n", name);
+        return false;
+    }
+    //get the offset of the entry and write the bytes
+    off_t offset = node->offsets[i];
+    directoryEntry entry = node->entries[i];
+    uint32_t startCluster = ((uint32_t)entry.DIR_FstClusHI << 16) | entry.DIR_FstClusLO;
+    entry.DIR_Name[0] = (char)0xE5;
+    if (!writeDirectoryEntry(directoryCluster, offset, &entry)) {
+        return false;
+    }
+    freeClusterChain(startCluster, entry.DIR_Attr & ATTR_DIRECTORY);
+    return true;
+}
+
+bool removeTree(const char *name) {
+    // rm -r command, deletes a directory and everything below it. The subtree is walked
+    // first, then every chain is freed with FAT write back held until the end
+    loadDirectoryEntries(currentClusterNumber);
+    directoryEntry *found = find_file_in_directory(name);
+    if (found == NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        printf("Error: File '%s' not found.\n", name);
+        return false;
+    }
+    if (!(found->DIR_Attr & ATTR_DIRECTORY)) {
+        return removeFile(name);
+    }
+    uint32_t top = ((uint32_t)found->DIR_FstClusHI << 16) | found->DIR_FstClusLO;
+
+    // collect the directories of the subtree, the bitmap stops loops in a damaged image
+    uint64_t *seen = calloc(image->maxClus / 64 + 1, sizeof(uint64_t));
+    uint32_t numDirs = 0, dirCapacity = 64;
+    uint32_t *dirs = malloc(dirCapacity * sizeof(uint32_t));
+    if (seen == NULL || dirs == NULL) {
+        perror("Error allocating memory for rm -r");
+        free(seen);
+        free(dirs);
+        return false;
+    }
+    if (top >= 2 && top <= image->maxClus) {
+        seen[top / 64] |= 1ULL << (top % 64);
+        dirs[numDirs++] = top;
+    }
+    for (uint32_t d = 0; d < numDirs; d++) {
+        dirCacheNode *node = getDirectory(dirs[d]);
+        for (int i = 0; node != NULL && i < node->numEntries; i++) {
+            directoryEntry *entry = &node->entries[i];
+            uint32_t cluster = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+            if (!isIndexedEntry(entry) || entry->DIR_Attr == 0x0F || entry->DIR_Name[0] == '.'
+                || !(entry->DIR_Attr & ATTR_DIRECTORY) || cluster < 2 || cluster > image->maxClus
+                || (seen[cluster / 64] & (1ULL << (cluster % 64)))) {
+                continue;
+            }
+            if (numDirs == dirCapacity) {
+                dirCapacity *= 2;
+                uint32_t *grown = realloc(dirs, dirCapacity * sizeof(uint32_t));
+                if (grown == NULL) {
+                    perror("Error allocating memory for rm -r");
+                    free(seen);
+                    free(dirs);
+                    return false;
+                }
+                dirs = grown;
+            }
+            seen[cluster / 64] |= 1ULL << (cluster % 64);
+            dirs[numDirs++] = cluster;
+        }
+    }
+    // open files below the directory would keep using freed clusters
+    for (int i = 0; i < numOpenedFiles; i++) {
+        uint32_t c = opened_files[i].dir_cluster;
+        if (c >= 2 && c <= image->maxClus && (seen[c / 64] & (1ULL << (c % 64)))) {
+            printf("Error: File '%s' below '%s' is open. Please close.\n", opened_files[i].name, name);
+            free(seen);
+            free(dirs);
+            return false;
+        }
+    }
+
+    // free the file chains of each directory and then the directory, the top one goes
+    // last together with its entry
+    uint32_t threshold = fatDirtyThreshold;
+    fatDirtyThreshold = 0;
+    for (uint32_t d = 0; d < numDirs; d++) {
+        dirCacheNode *node = getDirectory(dirs[d]);
+        for (int i = 0; node != NULL && i < node->numEntries; i++) {
+            directoryEntry *entry = &node->entries[i];
+            if (isIndexedEntry(entry) && entry->DIR_Attr != 0x0F && !(entry->DIR_Attr & ATTR_DIRECTORY)) {
+                freeClusterChain(((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO, false);
+            }
+        }
+        if (d > 0) {
+            freeClusterChain(dirs[d], true);
+        }
     }
-    
+    bool ok = removeEntry(currentClusterNumber, name);
+    fatDirtyThreshold = threshold;
+    if (threshold > 0 && fatDirtyCount >= threshold) {
+        flushFATTable();
+    }
+    free(seen);
+    free(dirs);
+    return ok;
 }
 
-void open_file_for_read(const char* filename) {
-    // Opens files for reading
-    loadDirectoryEntries(currentClusterNumber);
-    directoryEntry* file_entry = find_file_in_directory(filename);
-    
-    if (file_entry == NULL) {
-	printf("Error: File '%s' not found.\n", filename);
-	return;
+uint32_t parentDirectoryCluster(uint32_t directoryCluster) {
+    // Returns the cluster a directory's '..' entry points at, the root has no parent
+    if (directoryCluster == image->rootClus) {
+        return 0;
+    }
+    dirCacheNode *node = getDirectory(directoryCluster);
+    int i = findEntryIndex(node, "..");
+    if (i < 0) {
+        return 0;
     }
+    uint32_t cluster = ((uint32_t)node->entries[i].DIR_FstClusHI << 16) | node->entries[i].DIR_FstClusLO;
+    return (cluster == 0) ? image->rootClus : cluster;
+}
 
-    // Makes sure a file is not already opened	
+bool resolveDestination(const char *destination, const char *source, uint32_t *directoryCluster, char *name) {
+    // Splits a mv or cp destination into the directory it names and the new entry name,
+    // a destination naming a directory keeps the source name; name holds 256 bytes
+    char path[256];
+    strncpy(path, destination, sizeof(path) - 1);
+    path[sizeof(path) - 1] = '\0';
+    uint32_t targetCluster = currentClusterNumber;
+    const char *newName = path;
+    char *slash = strrchr(path, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+        newName = slash + 1;
+        targetCluster = (path[0] == '\0') ? image->rootClus : getClusterNumber(path);
+        if (targetCluster == 0) {
+            return false;
+        }
+    }
+    if (newName[0] == '\0' || strcmp(newName, ".") == 0 || strcmp(newName, "..") == 0) {
+        if (strcmp(newName, "..") == 0) {
+            targetCluster = parentDirectoryCluster(targetCluster);
+            if (targetCluster == 0) {
+                printf("Error: The root directory has no parent.\n");
+                return false;
+            }
+        }
+        newName = source;
+    } else {
+        dirCacheNode *target = getDirectory(targetCluster);
+        int i = findEntryIndex(target, newName);
+        if (i >= 0 && (target->entries[i].DIR_Attr & ATTR_DIRECTORY)) {
+            uint32_t cluster = ((uint32_t)target->entries[i].DIR_FstClusHI << 16) | target->entries[i].DIR_FstClusLO;
+            targetCluster = (cluster == 0) ? image->rootClus : cluster;
+            newName = source;
+        }
+    }
+    if (!checkEntryName(newName)) {
+        return false;
+    }
+    strcpy(name, newName);
+    *directoryCluster = targetCluster;
+    return true;
+}
+
+bool moveEntry(const char *source, const char *destination) {
+    // mv command, moves the 32 byte entry of a file or directory to a new name and/or
+    // directory, the data clusters stay where they are
+    if (strcmp(source, ".") == 0 || strcmp(source, "..") == 0) {
+        printf("Error: Cannot move '%s'.\n", source);
+        return false;
+    }
     for (int i = 0; i < numOpenedFiles; ++i) {
-	if (strcmp(opened_files[i].name, filename) == 0 && opened_files[i].is_open) {
-	    printf("Error: File '%s' is already open.\n", filename);
-	    return;
-	}
+        if (strcmp(opened_files[i].name, source) == 0 && opened_files[i].is_open) {
+            printf("Error: File '%s' is open. Please close.\n", source);
+            return false;
+        }
+    }
+    loadDirectoryEntries(currentClusterNumber);
+    directoryEntry *found = find_file_in_directory(source);
+    if (found == NULL) {
+        printf("Error: File '%s' not found.\n", source);
+        return false;
     }
+    directoryEntry entry = *found;
+    off_t sourceOffset = compute_dentry_offset(currentClusterNumber, source);
+    bool isDirectory = entry.DIR_Attr & ATTR_DIRECTORY;
+    uint32_t entryCluster = ((uint32_t)entry.DIR_FstClusHI << 16) | entry.DIR_FstClusLO;
 
-    // Initializes a new opened file	
-    open_file new_file;
-    strncpy(new_file.name, filename, 11);
-    new_file.is_open = 1;
-    new_file.start_cluster = (file_entry->DIR_FstClusHI << 16) | file_entry->DIR_FstClusLO;
-    new_file.size = file_entry->DIR_FileSize;
-    new_file.offset = 0;
-    new_file.access_mode = 0x01;
-    strcpy(currentDirectory, new_file.path);
+    uint32_t targetCluster;
+    char newName[256];
+    if (!resolveDestination(destination, source, &targetCluster, newName)) {
+        return false;
+    }
+    if (findEntryIndex(getDirectory(targetCluster), newName) >= 0) {
+        if (targetCluster == currentClusterNumber && strcmp(newName, source) == 0) {
+            return true;   // moved onto itself
+        }
+        printf("Error: '%s' already exists.\n", newName);
+        return false;
+    }
+    // a directory cannot end up inside its own subtree
+    if (isDirectory) {
+        for (uint32_t c = targetCluster; c != 0; c = parentDirectoryCluster(c)) {
+            if (c == entryCluster) {
+                printf("Error: Cannot move '%s' into itself.\n", source);
+                return false;
+            }
+        }
+    }
 
-    // Make updates to opened files array	
-    opened_files = realloc(opened_files, (numOpenedFiles + 1) * sizeof(open_file));
-    opened_files[numOpenedFiles] = new_file;
-    numOpenedFiles++;
+    directoryEntry deleted = entry;
+    deleted.DIR_Name[0] = (char)0xE5;
+    memset(entry.DIR_Name, 0, 11);
+    strncpy(entry.DIR_Name, newName, 11);
+    if (targetCluster == currentClusterNumber) {
+        // a rename rewrites the entry in place
+        return writeDirectoryEntry(currentClusterNumber, sourceOffset, &entry);
+    }
+
+    // write the entry into its new directory before the old slot is given up
+    off_t targetOffset = findFreeDirectorySlot(targetCluster);
+    if (targetOffset == 0) {
+        printf("Error: No free directory entries.\n");
+        return false;
+    }
+    if (!writeDirectoryEntry(targetCluster, targetOffset, &entry)) {
+        return false;
+    }
+    if (!writeDirectoryEntry(currentClusterNumber, sourceOffset, &deleted)) {
+        return false;
+    }
+
+    // the moved directory's '..' has to point at its new parent, 0 meaning the root
+    if (isDirectory && entryCluster >= 2) {
+        dirCacheNode *node = getDirectory(entryCluster);
+        int i = findEntryIndex(node, "..");
+        if (i >= 0) {
+            directoryEntry dotdot = node->entries[i];
+            uint32_t parent = (targetCluster == image->rootClus) ? 0 : targetCluster;
+            dotdot.DIR_FstClusHI = (parent >> 16) & 0xFFFF;
+            dotdot.DIR_FstClusLO = parent & 0xFFFF;
+            if (!writeDirectoryEntry(entryCluster, node->offsets[i], &dotdot)) {
+                return false;
+            }
+        }
+    }
+    return true;
 }
 
-void closeFile(const char* filename) {
-    //check to see if file exists
+bool makeDirectory(const char *dirname) {
+    if (!checkEntryName(dirname)) {
+        return false;
+    }
     loadDirectoryEntries(currentClusterNumber);
-    directoryEntry* fileEntry = find_file_in_directory(filename);
-    if (fileEntry == NULL) {
-        printf("Error: File '%s' not found.\n", filename);
-        return;
+
+    // Check if the directory already exists
+    if (find_file_in_directory(dirname) != NULL) {
+        printf("Error: Directory already exists.\n");
+        return false;
+    }
+    // Find a free entry in the parent before taking a cluster
+    off_t parentOffset = findFreeDirectorySlot(currentClusterNumber);
+    if (parentOffset == 0) {
+	return false;
     }
 
-    //check if file is open
-    bool fileOpen = false;
-    for (int i = 0; i < numOpenedFiles; ++i) {
-        if (strcmp(opened_files[i].name, filename) == 0 && opened_files[i].is_open) {
-            fileOpen = true;
-            //remove the file entry from the open file list
-            for (int j = i; j < numOpenedFiles - 1; ++j) {
-                opened_files[j] = opened_files[j + 1];
+    // Allocate a new cluster for the directory
+    uint32_t newCluster = allocateNewCluster();
+    if (newCluster == 0) {
+	return false;
+    }
+    invalidateDirectoryCache(newCluster);
+    invalidatePathCacheDirectory(newCluster);
+
+    // Compute cluster size
+    uint32_t clusterSize = image->sectpClus * image->BpSect;
+
+    // Build the new cluster with its dot entries in the buffer cache, the rest stays zeroed
+    directoryEntry *cluster = (directoryEntry *)bufferCacheGet(newCluster, false);
+    if (cluster == NULL) {
+	return false;
+    }
+    memset(cluster, 0, clusterSize);
+    directoryEntry *dotEntry = &cluster[0];
+    directoryEntry *dotDotEntry = &cluster[1];
+
+    // Initialize dot entries	
+    strncpy(dotEntry->DIR_Name, ".          ", 11);
+    dotEntry->DIR_Attr = ATTR_DIRECTORY;
+    dotEntry->DIR_FstClusHI = (newCluster >> 16) & 0xFFFF;
+    dotEntry->DIR_FstClusLO = newCluster & 0xFFFF;
+    dotEntry->DIR_FileSize = 0;
+
+    // '..' of a directory in the root points at cluster 0
+    uint32_t parentCluster = (currentClusterNumber == image->rootClus) ? 0 : currentClusterNumber;
+    strncpy(dotDotEntry->DIR_Name, "..         ", 11);
+    dotDotEntry->DIR_Attr = ATTR_DIRECTORY;
+    dotDotEntry->DIR_FstClusHI = (parentCluster >> 16) & 0xFFFF;
+    dotDotEntry->DIR_FstClusLO = parentCluster & 0xFFFF;
+    dotDotEntry->DIR_FileSize = 0;
+
+    // The whole cluster goes back to the image in one write when it is flushed
+    bufferCacheRelease(newCluster, true);
+
+    // Write new directory entry into the parent
+    directoryEntry entry;
+    memset(&entry, 0, sizeof(directoryEntry));
+    strncpy(entry.DIR_Name, dirname, 11);
+    entry.DIR_Attr = ATTR_DIRECTORY;
+    entry.DIR_FstClusHI = (newCluster >> 16) & 0xFFFF;
+    entry.DIR_FstClusLO = newCluster & 0xFFFF;
+    entry.DIR_FileSize = 0;
+    return writeDirectoryEntry(currentClusterNumber, parentOffset, &entry);
+}
+
+bool createFile(const char *filename) {
+    return createFileInDirectory(currentClusterNumber, filename);
+}
+
+bool createFileInDirectory(uint32_t directoryCluster, const char *filename) {
+    // Adds an empty file entry to a directory
+    if (!checkEntryName(filename)) {
+        return false;
+    }
+    if (findEntryIndex(getDirectory(directoryCluster), filename) >= 0) {
+        printf("Error: File already exists.\n");
+        return false;
+    }
+    
+    //find a free entry in the cluster chain, the directory grows if it is full
+    off_t offset = findFreeDirectorySlot(directoryCluster);
+    if (offset == 0) {
+        printf("Error: No free directory entries.\n");
+        return false;
+    }
+
+    directoryEntry entry;
+    memset(&entry, 0, sizeof(directoryEntry));
+    strncpy(entry.DIR_Name, filename, 11);
+    entry.DIR_Attr = ATTR_ARCHIVE;
+    // empty files own no cluster until something is written
+    entry.DIR_FstClusHI = 0;
+    entry.DIR_FstClusLO = 0;
+    entry.DIR_FileSize = 0;
+    return writeDirectoryEntry(directoryCluster, offset, &entry);
+}
+
+
+ssize_t fdRead(void *buf, size_t len, off_t offset) {
+    // pread until len bytes arrived or the image ended
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(image->fd, (char *)buf + done, len - done, offset + done);
+        countIO(IO_PREAD, n);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return done > 0 ? (ssize_t)done : n;
+        }
+        done += n;
+    }
+    return done;
+}
+
+ssize_t fdWrite(const void *buf, size_t len, off_t offset) {
+    // pwrite until len bytes are written
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(image->fd, (const char *)buf + done, len - done, offset + done);
+        countIO(IO_PWRITE, n);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return done > 0 ? (ssize_t)done : n;
+        }
+        done += n;
+    }
+    return done;
+}
+
+ssize_t fdVector(const struct iovec *iov, int count, off_t offset, bool toImage) {
+    // preadv/pwritev in IOV_MAX batches, short transfers are finished one buffer at a time
+    size_t done = 0;
+    int i = 0;
+    while (i < count) {
+        int batch = (count - i < IOV_MAX) ? count - i : IOV_MAX;
+        ssize_t n = toImage ? pwritev(image->fd, iov + i, batch, offset + done)
+                            : preadv(image->fd, iov + i, batch, offset + done);
+        countIO(toImage ? IO_PWRITEV : IO_PREADV, n);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return done > 0 ? (ssize_t)done : n;
+        }
+        size_t left = n;
+        while (i < count && left >= iov[i].iov_len) {
+            left -= iov[i].iov_len;
+            done += iov[i].iov_len;
+            i++;
+        }
+        if (left > 0) {
+            char *base = (char *)iov[i].iov_base + left;
+            size_t rest = iov[i].iov_len - left;
+            ssize_t m = toImage ? fdWrite(base, rest, offset + done + left)
+                                : fdRead(base, rest, offset + done + left);
+            if (m != (ssize_t)rest) {
+                return done + left + (m > 0 ? m : 0);
             }
-            numOpenedFiles--;
-            break;
+            done += iov[i].iov_len;
+            i++;
+        }
+    }
+    return done;
+}
+
+ssize_t fdReadv(const struct iovec *iov, int count, off_t offset) {
+    return fdVector(iov, count, offset, false);
+}
+
+ssize_t fdWritev(const struct iovec *iov, int count, off_t offset) {
+    return fdVector(iov, count, offset, true);
+}
+
+size_t segmentLength(const ioSegment *segment) {
+    size_t len = 0;
+    for (int i = 0; i < segment->iovcnt; i++) {
+        len += segment->iov[i].iov_len;
+    }
+    return len;
+}
+
+bool fdReadBatch(const ioSegment *segments, int count) {
+    // one preadv after the other
+    for (int i = 0; i < count; i++) {
+        if (fdReadv(segments[i].iov, segments[i].iovcnt, segments[i].offset) != (ssize_t)segmentLength(&segments[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+char *fdMap(off_t offset, size_t len) {
+    // the fd backend has nothing mapped
+    return NULL;
+}
+
+bool fdSync() {
+    return true;
+}
+
+void fdClose() {
+}
+
+char *mmapWindowFor(off_t offset, size_t *avail) {
+    // Returns a pointer to offset through a window, mapping one if needed
+    mmapClock++;
+    mmapWindow *victim = &mmapWindows[0];
+    for (int i = 0; i < MMAP_WINDOWS; i++) {
+        mmapWindow *w = &mmapWindows[i];
+        if (w->base != NULL && offset >= w->start && offset < w->start + (off_t)w->len) {
+            w->lastUse = mmapClock;
+            *avail = w->len - (offset - w->start);
+            return w->base + (offset - w->start);
+        }
+        if (w->base == NULL || (victim->base != NULL && w->lastUse < victim->lastUse)) {
+            victim = w;
+        }
+    }
+    if (victim->base != NULL) {
+        munmap(victim->base, victim->len);
+        victim->base = NULL;
+    }
+    off_t start = offset - offset % MMAP_WINDOW_SIZE;
+    size_t len = MMAP_WINDOW_SIZE;
+    if (start + (off_t)len > image->size) {
+        len = image->size - start;
+    }
+    char *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, image->fd, start);
+    countIO(IO_MMAP, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    victim->base = base;
+    victim->start = start;
+    victim->len = len;
+    victim->lastUse = mmapClock;
+    *avail = len - (offset - start);
+    return base + (offset - start);
+}
+
+ssize_t mmapCopy(char *buf, size_t len, off_t offset, bool toImage) {
+    // Copies between buf and the mapped image, clipped to the image size
+    if (offset >= image->size) {
+        return 0;
+    }
+    if (offset + (off_t)len > image->size) {
+        len = image->size - offset;
+    }
+    countIO(toImage ? IO_MMAP_WRITE : IO_MMAP_READ, len);
+    if (mmapBase != NULL) {
+        if (toImage) {
+            memcpy(mmapBase + offset, buf, len);
+        } else {
+            memcpy(buf, mmapBase + offset, len);
+        }
+        return len;
+    }
+    size_t done = 0;
+    while (done < len) {
+        size_t avail;
+        char *p = mmapWindowFor(offset + done, &avail);
+        if (p == NULL) {
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        size_t n = (len - done < avail) ? len - done : avail;
+        if (toImage) {
+            memcpy(p, buf + done, n);
+        } else {
+            memcpy(buf + done, p, n);
         }
+        done += n;
+    }
+    return done;
+}
+
+ssize_t mmapRead(void *buf, size_t len, off_t offset) {
+    return mmapCopy(buf, len, offset, false);
+}
+
+ssize_t mmapWrite(const void *buf, size_t len, off_t offset) {
+    return mmapCopy((char *)buf, len, offset, true);
+}
+
+ssize_t mmapVector(const struct iovec *iov, int count, off_t offset, bool toImage) {
+    // a mapped image needs no syscall per buffer, copy them one after another
+    size_t done = 0;
+    for (int i = 0; i < count; i++) {
+        ssize_t n = mmapCopy(iov[i].iov_base, iov[i].iov_len, offset + done, toImage);
+        if (n != (ssize_t)iov[i].iov_len) {
+            return done + (n > 0 ? n : 0);
+        }
+        done += n;
+    }
+    return done;
+}
+
+ssize_t mmapReadv(const struct iovec *iov, int count, off_t offset) {
+    return mmapVector(iov, count, offset, false);
+}
+
+ssize_t mmapWritev(const struct iovec *iov, int count, off_t offset) {
+    return mmapVector(iov, count, offset, true);
+}
+
+bool mmapReadBatch(const ioSegment *segments, int count) {
+    for (int i = 0; i < count; i++) {
+        if (mmapReadv(segments[i].iov, segments[i].iovcnt, segments[i].offset) != (ssize_t)segmentLength(&segments[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+char *mmapMap(off_t offset, size_t len) {
+    // Only a whole image mapping hands out pointers, windows may move under the caller
+    if (mmapBase == NULL || offset + (off_t)len > image->size) {
+        return NULL;
+    }
+    return mmapBase + offset;
+}
+
+bool mmapSync() {
+    // Pushes dirty mapped pages to the image file
+    if (mmapBase != NULL) {
+        countIO(IO_MSYNC, 0);
+        return msync(mmapBase, image->size, MS_SYNC) == 0;
+    }
+    for (int i = 0; i < MMAP_WINDOWS; i++) {
+        if (mmapWindows[i].base == NULL) {
+            continue;
+        }
+        countIO(IO_MSYNC, 0);
+        if (msync(mmapWindows[i].base, mmapWindows[i].len, MS_SYNC) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void mmapClose() {
+    // Unmaps the image, the kernel writes remaining dirty pages back
+    if (mmapBase != NULL) {
+        munmap(mmapBase, image->size);
+        mmapBase = NULL;
+    }
+    for (int i = 0; i < MMAP_WINDOWS; i++) {
+        if (mmapWindows[i].base != NULL) {
+            munmap(mmapWindows[i].base, mmapWindows[i].len);
+            mmapWindows[i].base = NULL;
+        }
+    }
+}
+
+bool uringInit() {
+    // Sets up the rings with raw syscalls, false when the kernel refuses io_uring
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(&uring, 0, sizeof(uring));
+    uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring.fd < 0) {
+        return false;
+    }
+    uring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring.cqRingSize > uring.sqRingSize) {
+            uring.sqRingSize = uring.cqRingSize;
+        }
+        uring.cqRingSize = uring.sqRingSize;
+    }
+    uring.sqRing = mmap(NULL, uring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    uring.cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? uring.sqRing :
+        mmap(NULL, uring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+    uring.sqes = mmap(NULL, uring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (uring.sqRing == MAP_FAILED || uring.cqRing == MAP_FAILED || uring.sqes == MAP_FAILED) {
+        close(uring.fd);
+        return false;
+    }
+    char *sq = uring.sqRing, *cq = uring.cqRing;
+    uring.sqHead = (unsigned *)(sq + params.sq_off.head);
+    uring.sqTail = (unsigned *)(sq + params.sq_off.tail);
+    uring.sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring.sqArray = (unsigned *)(sq + params.sq_off.array);
+    uring.cqHead = (unsigned *)(cq + params.cq_off.head);
+    uring.cqTail = (unsigned *)(cq + params.cq_off.tail);
+    uring.cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+void uringReap(const ioSegment *segments, char *finished, int *inflight, bool *ok) {
+    // Takes every completion the kernel has posted; a failed or short one is redone with preadv
+    size_t bytes = 0;
+    unsigned head = *uring.cqHead;
+    while (head != __atomic_load_n(uring.cqTail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cqMask];
+        const ioSegment *segment = &segments[cqe->user_data];
+        ssize_t expected = segmentLength(segment);
+        if (cqe->res == expected) {
+            bytes += expected;
+        } else if (fdReadv(segment->iov, segment->iovcnt, segment->offset) != expected) {
+            *ok = false;
+        }
+        finished[cqe->user_data] = 1;
+        head++;
+        (*inflight)--;
+    }
+    __atomic_store_n(uring.cqHead, head, __ATOMIC_RELEASE);
+    countIO(IO_URING_ENTER, bytes);
+}
+
+bool uringReadBatch(const ioSegment *segments, int count) {
+    // Queues every segment as a READV and reaps completions in whatever order they finish
+    char *finished = calloc(count > 0 ? count : 1, 1);
+    if (finished == NULL) {
+        return fdReadBatch(segments, count);
+    }
+    int next = 0, inflight = 0, done = 0;
+    bool ok = true;
+    while (done < count) {
+        unsigned tail = *uring.sqTail;
+        unsigned mask = *uring.sqMask;
+        while (next < count && inflight < URING_ENTRIES) {
+            unsigned slot = tail & mask;
+            struct io_uring_sqe *sqe = &uring.sqes[slot];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READV;
+            sqe->fd = image->fd;
+            sqe->addr = (uint64_t)(uintptr_t)segments[next].iov;
+            sqe->len = segments[next].iovcnt;
+            sqe->off = segments[next].offset;
+            sqe->user_data = next;
+            uring.sqArray[slot] = slot;
+            tail++;
+            next++;
+            inflight++;
+        }
+        __atomic_store_n(uring.sqTail, tail, __ATOMIC_RELEASE);
+
+        unsigned unsubmitted = tail - __atomic_load_n(uring.sqHead, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, uring.fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("io_uring_enter");
+            // take back the entries the kernel never consumed and wait for the ones it did,
+            // their buffers must stay alive until the reads have landed
+            unsubmitted = tail - __atomic_load_n(uring.sqHead, __ATOMIC_ACQUIRE);
+            __atomic_store_n(uring.sqTail, tail - unsubmitted, __ATOMIC_RELEASE);
+            inflight -= unsubmitted;
+            while (inflight > 0) {
+                if (syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+                    && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                    break;
+                }
+                uringReap(segments, finished, &inflight, &ok);
+            }
+            // the rest is read with preadv, as is everything after this batch
+            for (int i = 0; i < count; i++) {
+                if (!finished[i] && fdReadv(segments[i].iov, segments[i].iovcnt, segments[i].offset) != (ssize_t)segmentLength(&segments[i])) {
+                    ok = false;
+                }
+            }
+            printf("io_uring stopped working, using pread.\n");
+            imageIO = &fdBackend;
+            free(finished);
+            return ok;
+        }
+        int before = inflight;
+        uringReap(segments, finished, &inflight, &ok);
+        done += before - inflight;
+    }
+    free(finished);
+    return ok;
+}
+
+void uringClose() {
+    munmap(uring.sqes, uring.sqesSize);
+    if (uring.cqRing != uring.sqRing) {
+        munmap(uring.cqRing, uring.cqRingSize);
     }
+    munmap(uring.sqRing, uring.sqRingSize);
+    close(uring.fd);
+}
 
-    if (!fileOpen) {
-        printf("Error: File '%s' is not open.\n", filename);
+ioBackend fdBackend = { "fd", fdRead, fdWrite, fdReadv, fdWritev, fdReadBatch, fdMap, fdSync, fdClose };
+ioBackend mmapBackend = { "mmap", mmapRead, mmapWrite, mmapReadv, mmapWritev, mmapReadBatch, mmapMap, mmapSync, mmapClose };
+ioBackend uringBackend = { "io_uring", fdRead, fdWrite, fdReadv, fdWritev, uringReadBatch, fdMap, fdSync, uringClose };
+
+bool initImageIO(const char *backendName) {
+    // Selects the block access backend for the opened image
+    imageIO = &fdBackend;
+    if (strcmp(backendName, "io_uring") == 0) {
+        if (uringInit()) {
+            imageIO = &uringBackend;
+        } else {
+            printf("io_uring is not available (%s), using pread.\n", strerror(errno));
+        }
+        return true;
+    }
+    if (strcmp(backendName, "mmap") != 0) {
+        return true;
     }
+    if (image->size <= 0) {
+        errno = EINVAL;
+        return false;
+    }
+    memset(mmapWindows, 0, sizeof(mmapWindows));
+    mmapBase = mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_SHARED, image->fd, 0);
+    countIO(IO_MMAP, 0);
+    if (mmapBase == MAP_FAILED) {
+        // not enough address space, fall back to mapping windows on demand
+        mmapBase = NULL;
+    }
+    imageIO = &mmapBackend;
+    return true;
+}
 
+void closeImageIO() {
+    imageIO->close();
 }
 
-void read_data_from_file(const char *filename, int size) {
-    open_file* file = NULL;
+ssize_t imageRead(void *buf, size_t len, off_t offset) {
+    return imageIO->read(buf, len, offset);
+}
 
-    // Makes sure a file exists and is open for reading	
-    for (int i = 0; i < numOpenedFiles; ++i) {
-	if (strcmp(opened_files[i].name, filename) == 0 && opened_files[i].is_open) {
-	    file = &opened_files[i];
-	    break;
-	}
-    }
+ssize_t imageWrite(const void *buf, size_t len, off_t offset) {
+    return imageIO->write(buf, len, offset);
+}
 
-    if (file == NULL) {
-	printf("Error: File '%s' not found.\n", filename);
-	return;
-    }
+char *imageMap(off_t offset, size_t len) {
+    return imageIO->map(offset, len);
+}
 
-    if (file->access_mode != 0x01) {
-	printf("Error: File '%s' is not opened for reading.\n", filename);
-	return;
-    }
+bool imageSync() {
+    return imageIO->sync();
+}
 
-    if (file->offset >= file->size) {
-	return;
-    }
+ssize_t imageReadv(const struct iovec *iov, int count, off_t offset) {
+    return imageIO->readv(iov, count, offset);
+}
 
-    if (file->offset + size > file->size) {
-	size = file->size - file->offset;
-    }
+ssize_t imageWritev(const struct iovec *iov, int count, off_t offset) {
+    return imageIO->writev(iov, count, offset);
+}
 
-    // Calculate cluster and offset	
-    uint32_t cluster = file->start_cluster + (file->offset / (image->sectpClus * image->BpSect));
-    uint32_t offset = convert_cluster_to_offset(cluster) + (file->offset % (image->sectpClus * 
-			    image->BpSect));
-    char* buffer = malloc(size);
-    ssize_t bytes_read = pread(image->fd, buffer, size, offset);
+bool imageReadBatch(const ioSegment *segments, int count) {
+    return imageIO->readBatch(segments, count);
+}
 
-    if (bytes_read != size) {
-	free(buffer);
-	return;
+void countIO(int kind, ssize_t bytes) {
+    // parallel read workers count concurrently
+    __atomic_fetch_add(&ioStats[kind].calls, 1, __ATOMIC_RELAXED);
+    if (bytes > 0) {
+        __atomic_fetch_add(&ioStats[kind].bytes, bytes, __ATOMIC_RELAXED);
     }
+}
 
-    // Print data that was read from file	
-    printf("Data read from file '%s':\n", filename);
-    for (int i = 0; i < size; ++i) {
-	printf("%c", buffer[i]);
+uint64_t ioSyscallTotal() {
+    uint64_t total = 0;
+    for (int i = 0; i < IO_SYSCALL_KINDS; i++) {
+        total += ioStats[i].calls;
     }
-    printf("\n");
-
-    free(buffer);
-    file->offset += bytes_read;
+    return total;
 }
 
-void write_data_to_file(const char *filename, const char *data) {
-    // Checks to make sure if file exists or is open
-    open_file *file = NULL;
-    for (int i = 0; i < numOpenedFiles; i++) {
-	if (strcmp(opened_files[i].name, filename) == 0 && opened_files[i].is_open) {
-	    file = &opened_files[i];
-	    break;
-	}
+void recordCommandStats(const char *name, bool ok, uint64_t ns, uint64_t syscalls) {
+    // Adds one run of a command to its latency histogram and syscall totals
+    commandStats *stats = NULL;
+    for (int i = 0; i < numCommandStats && stats == NULL; i++) {
+        if (strcmp(commandStatsTable[i].name, name) == 0) {
+            stats = &commandStatsTable[i];
+        }
     }
-    
-    if (file == NULL) {
-	printf("Error: File '%s' not found or not opened.\n", filename);
-	return;
+    if (stats == NULL) {
+        if (numCommandStats == STATS_MAX_COMMANDS) {
+            return;
+        }
+        stats = &commandStatsTable[numCommandStats++];
+        memset(stats, 0, sizeof(commandStats));
+        strncpy(stats->name, name, sizeof(stats->name) - 1);
     }
-
-    // Check that the file is not read only	
-    if (file->access_mode == 0x01) {
-	printf("Error: File '%s' is not write accessible.\n", filename);
-	return;
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+    while (bucket < STATS_BUCKETS - 1 && (1ULL << bucket) <= us) {
+        bucket++;
     }
+    stats->buckets[bucket]++;
+    stats->count++;
+    stats->errors += !ok;
+    stats->totalNs += ns;
+    stats->syscalls += syscalls;
+    if (ns > stats->maxNs) {
+        stats->maxNs = ns;
+    }
+    if (syscalls > stats->maxSyscalls) {
+        stats->maxSyscalls = syscalls;
+    }
+}
 
-    // Allow write until out of bytes
-    int dataLength = strlen(data);
-    int remainingBytes = dataLength;
-    int dataOffset = file->offset;
-    int clusterSize = image->sectpClus * image->BpSect;
-
-    uint32_t cluster = file->start_cluster + (dataOffset / clusterSize);
-    uint32_t clusterOffset = convert_cluster_to_offset(cluster) + (dataOffset % clusterSize);
-
-    while (remainingBytes > 0) {
-	int spaceInCluster = clusterSize - (clusterOffset % clusterSize);
-	int bytesToWrite = (remainingBytes < spaceInCluster) ? remainingBytes : spaceInCluster;
-
-	ssize_t bytesWritten = pwrite(image->fd, data, bytesToWrite, clusterOffset);
+uint64_t statsPercentileUs(commandStats *stats, double q) {
+    // Upper bound of the histogram bucket holding the q quantile
+    uint64_t target = (uint64_t)(q * stats->count + 0.999999);
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += stats->buckets[b];
+        if (seen >= target && seen > 0) {
+            return 1ULL << b;
+        }
+    }
+    return 1ULL << (STATS_BUCKETS - 1);
+}
 
-	if (bytesWritten != bytesToWrite) {
-	    return;
-	}
+void resetStats() {
+    memset(ioStats, 0, sizeof(ioStats));
+    numCommandStats = 0;
+    bufferCacheHits = 0;
+    bufferCacheMisses = 0;
+    bufferCachePrefetched = 0;
+}
 
-	remainingBytes -= bytesWritten;
-	data += bytesWritten;
-	clusterOffset += bytesWritten;
-
-	if (clusterOffset % clusterSize == 0) {
-	    uint32_t nextCluster = getNextCluster(cluster);
-   	    
-	    if (nextCluster == 0) {
-		nextCluster = allocateNewCluster();
-		if (nextCluster == 0) {
-    		    return;
-		}
-	    
-	        setFATEntry(cluster, nextCluster);
-	    }
-	
+void printStats() {
+    // stats command, percentiles are histogram bucket bounds
+    printf("%-12s %12s %16s\n", "io", "calls", "bytes");
+    for (int i = 0; i < IO_STAT_KINDS; i++) {
+        printf("%-12s %12" PRIu64 " %16" PRIu64 "\n", ioStatNames[i], ioStats[i].calls, ioStats[i].bytes);
+    }
+    printf("buffer cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " clusters prefetched\n",
+           bufferCacheHits, bufferCacheMisses, bufferCachePrefetched);
+    printf("%-10s %8s %6s %10s %10s %10s %10s %10s %8s\n",
+           "command", "count", "errors", "avg_us", "p50_us<=", "p99_us<=", "max_us", "syscalls", "max");
+    for (int i = 0; i < numCommandStats; i++) {
+        commandStats *stats = &commandStatsTable[i];
+        printf("%-10s %8" PRIu64 " %6" PRIu64 " %10.1f %10" PRIu64 " %10" PRIu64 " %10.1f %10" PRIu64 " %8" PRIu64 "\n",
+               stats->name, stats->count, stats->errors, stats->totalNs / 1000.0 / stats->count,
+               statsPercentileUs(stats, 0.50), statsPercentileUs(stats, 0.99), stats->maxNs / 1000.0,
+               stats->syscalls, stats->maxSyscalls);
+    }
+}
 
-	    cluster = nextCluster;
-	    clusterOffset = convert_cluster_to_offset(cluster);
+void printStatsJSON(FILE *out) {
+    fprintf(out, "{\"io\": {");
+    for (int i = 0; i < IO_STAT_KINDS; i++) {
+        fprintf(out, "%s\"%s\": {\"calls\": %" PRIu64 ", \"bytes\": %" PRIu64 "}",
+                i ? ", " : "", ioStatNames[i], ioStats[i].calls, ioStats[i].bytes);
+    }
+    fprintf(out, "},\n \"buffer_cache\": {\"hits\": %" PRIu64 ", \"misses\": %" PRIu64 ", \"prefetched\": %" PRIu64 "},\n",
+            bufferCacheHits, bufferCacheMisses, bufferCachePrefetched);
+    fprintf(out, " \"commands\": {");
+    for (int i = 0; i < numCommandStats; i++) {
+        commandStats *stats = &commandStatsTable[i];
+        fprintf(out, "%s\n  \"%s\": {\"count\": %" PRIu64 ", \"errors\": %" PRIu64 ", \"total_ns\": %" PRIu64
+                ", \"max_ns\": %" PRIu64 ", \"syscalls\": %" PRIu64 ", \"max_syscalls\": %" PRIu64 ", \"histogram_us\": [",
+                i ? "," : "", stats->name, stats->count, stats->errors, stats->totalNs, stats->maxNs,
+                stats->syscalls, stats->maxSyscalls);
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            fprintf(out, "%s%" PRIu64, b ? ", " : "", stats->buckets[b]);
         }
+        fprintf(out, "]}");
     }
+    fprintf(out, "}}\n");
+}
 
-    file->offset += dataLength;
+bool runStatsCommand(tokenlist *tokens) {
+    // stats, stats reset or stats json
+    if (tokens->size < 2) {
+        printStats();
+        return true;
+    }
+    if (strcmp(tokens->items[1], "reset") == 0) {
+        resetStats();
+        return true;
+    }
+    if (strcmp(tokens->items[1], "json") == 0) {
+        printStatsJSON(stdout);
+        return true;
+    }
+    printf("Error: stats [reset|json]\n");
+    return false;
 }
 
-uint32_t compute_dentry_offset(uint32_t clusterNumber, const char* filename) {
-	// Computes offset of a directory entry
-        int fat32_fd = image->fd;
-        uint32_t clusterSize = image->sectpClus * image->BpSect;
-        uint32_t offset = image->dataStartOffset + (clusterNumber - 2) * clusterSize;
-        uint32_t end_offset = image->dataStartOffset + (clusterNumber - 2) * clusterSize + clusterSize;
-
-        while (offset + sizeof(directoryEntry) <= end_offset) {
-            directoryEntry *entry = encode_dir_entry(fat32_fd, offset);
-            if (compareDirectoryEntryName(entry->DIR_Name, filename)) {
-		return offset;
-            }
-            offset += sizeof(directoryEntry);
-        }
-        printf("offset not calc");
-        return 0;
+uint32_t bufferCacheClusterSize() {
+    return image->BpSect * image->sectpClus;
 }
 
-bool removeFile(const char *filename) {
-    //check if the file is open
-    for (int i = 0; i < numOpenedFiles; ++i) {
-        if (strcmp(opened_files[i].name, filename) == 0 && opened_files[i].is_open) {
-            printf("Error: File '%s' is open. Please close.\n", filename);
-            return false;
-        }
+cacheBlock *lookupBufferCache(uint32_t cluster) {
+    // Finds the cached block of a cluster or NULL
+    cacheBlock *block = bufferCacheBuckets[cluster % BUFFER_CACHE_BUCKETS];
+    while (block != NULL && block->cluster != cluster) {
+        block = block->hashNext;
     }
-    directoryEntry* dentry = find_file_in_directory(filename);
-    if (dentry == NULL) {
-        printf("Error: File '%s' not found.\n", filename);
+    return block;
+}
+
+void touchBufferCacheBlock(cacheBlock *block) {
+    // Moves a block to the front of the LRU list
+    if (bufferCacheHead == block) {
         return;
     }
-    
-    //get the offset of the entry and write the bytes
-    uint32_t offset = compute_dentry_offset(currentClusterNumber, filename);
-    dentry->DIR_Name[0] = 0x00;
-    ssize_t bytes_written = pwrite(image->fd, dentry, sizeof(directoryEntry), offset);
-    if (bytes_written != sizeof(directoryEntry)) {
-        printf("Error: Failed to write directory entry.\n");
-        return false;
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
     }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    if (bufferCacheTail == block) {
+        bufferCacheTail = block->prev;
+    }
+    block->prev = NULL;
+    block->next = bufferCacheHead;
+    if (bufferCacheHead != NULL) {
+        bufferCacheHead->prev = block;
+    }
+    bufferCacheHead = block;
+    if (bufferCacheTail == NULL) {
+        bufferCacheTail = block;
+    }
+}
 
+bool writeBufferCacheBlock(cacheBlock *block) {
+    // Writes one dirty block back to its cluster
+    uint32_t clusterSize = bufferCacheClusterSize();
+    if (imageWrite(block->data, clusterSize, convert_cluster_to_offset(block->cluster)) != clusterSize) {
+        printf("Error: Failed to write back cluster %" PRIu32 ".\n", block->cluster);
+        return false;
+    }
+    block->dirty = 0;
+    bufferCacheDirty--;
     return true;
-
 }
 
-bool makeDirectory(const char *dirname) {
-    loadDirectoryEntries(currentClusterNumber);
-
-    // Check if the directory already exists
-    for (int i = 0; i < numDirectoryEntries; i++) {
-        directoryEntry *entry = &directoryEntries[i];
-        if (compareDirectoryEntryName(entry->DIR_Name, dirname) == 1) {
-            printf("Error: Directory already exists.\n");
-            return false;
+void bufferCacheInvalidate(uint32_t firstCluster, uint32_t count) {
+    // Forgets cached copies of clusters that are about to be rewritten behind the cache
+    for (uint32_t c = firstCluster; c < firstCluster + count; c++) {
+        cacheBlock *block = lookupBufferCache(c);
+        if (block == NULL || block->pins > 0) {
+            continue;
         }
+        if (block->dirty) {
+            block->dirty = 0;
+            bufferCacheDirty--;
+        }
+        dropBufferCacheBlock(block);
     }
-    // Allocate a new cluster for the directory
-    uint32_t newCluster = allocateNewCluster();
-    if (newCluster == 0) {
-	return false;
-    }
+}
 
-    // Compute cluster size and cluster offset	
-    uint32_t clusterSize = image->sectpClus * image->BpSect;
-    uint32_t newClusterOffset = convert_cluster_to_offset(newCluster);
+void dropBufferCacheBlock(cacheBlock *block) {
+    // Unlinks a clean block from the hash chain and LRU list and frees it
+    cacheBlock **link = &bufferCacheBuckets[block->cluster % BUFFER_CACHE_BUCKETS];
+    while (*link != block) {
+        link = &(*link)->hashNext;
+    }
+    *link = block->hashNext;
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        bufferCacheHead = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    } else {
+        bufferCacheTail = block->prev;
+    }
+    bufferCacheBytes -= bufferCacheClusterSize();
+    free(block->data);
+    free(block);
+}
 
-    // Add dot entries to directory
-    directoryEntry dotEntry, dotDotEntry;
-    memset(&dotEntry, 0, sizeof(directoryEntry));
-    memset(&dotEntry, 0, sizeof(directoryEntry));
+void trimBufferCache() {
+    // Evicts unpinned blocks from the cold end until the cache fits its budget
+    cacheBlock *block = bufferCacheTail;
+    while (block != NULL && bufferCacheBytes > bufferCacheBudget) {
+        cacheBlock *prev = block->prev;
+        if (block->pins == 0 && (!block->dirty || writeBufferCacheBlock(block))) {
+            dropBufferCacheBlock(block);
+        }
+        block = prev;
+    }
+}
 
-    // Initialize dot entries	
-    strncpy(dotEntry.DIR_Name, ".          ", 11);
-    dotEntry.DIR_Attr = ATTR_DIRECTORY;
-    dotEntry.DIR_FstClusHI = (newCluster >> 16) & 0xFFFF;
-    dotEntry.DIR_FstClusLO = newCluster & 0xFFFF;
-    dotEntry.DIR_FileSize = 0;
-
-    strncpy(dotDotEntry.DIR_Name, "..         ", 11);
-    dotEntry.DIR_Attr = ATTR_DIRECTORY;
-    dotEntry.DIR_FstClusHI = (currentClusterNumber >> 16) & 0xFFFF;
-    dotEntry.DIR_FstClusLO = currentClusterNumber & 0xFFFF;
-    dotEntry.DIR_FileSize = 0;
-
-    // Write dot entry images	
-    ssize_t bytesWritten1 = pwrite(image->fd, &dotEntry, sizeof(directoryEntry), newClusterOffset);
-    ssize_t bytesWritten2 = pwrite(image->fd, &dotDotEntry, sizeof(directoryEntry), 
-		    newClusterOffset + sizeof(directoryEntry));
-
-    if (bytesWritten1 != sizeof(directoryEntry) || bytesWritten2 != sizeof(directoryEntry)) {
-	return false;
+cacheBlock *newBufferCacheBlock(uint32_t cluster) {
+    // Adds an empty, unpinned block for cluster at the front of the LRU list
+    cacheBlock *block = calloc(1, sizeof(cacheBlock));
+    if (block == NULL || posix_memalign((void **)&block->data, FAT_PAGE_SIZE, bufferCacheClusterSize()) != 0) {
+        free(block);
+        perror("Error allocating buffer cache block");
+        return NULL;
     }
+    block->cluster = cluster;
+    block->hashNext = bufferCacheBuckets[cluster % BUFFER_CACHE_BUCKETS];
+    bufferCacheBuckets[cluster % BUFFER_CACHE_BUCKETS] = block;
+    touchBufferCacheBlock(block);
+    bufferCacheBytes += bufferCacheClusterSize();
+    return block;
+}
 
-    // Create parent cluster offset and write new directory entry	
-    uint32_t parentClusterOffset = image->dataStartOffset + (currentClusterNumber - 2) * clusterSize;    
-    while (parentClusterOffset < image->dataStartOffset + (currentClusterNumber - 2 + 1) 
-		    * clusterSize) {
-        directoryEntry *entry = encode_dir_entry(image->fd, parentClusterOffset);
-        if (entry->DIR_Name[0] == 0x00 || entry->DIR_Name[0] == 0xE5) {
-            strncpy(entry->DIR_Name, dirname, 11);
-            entry->DIR_Attr = ATTR_DIRECTORY;
-            entry->DIR_FstClusHI = (newCluster >> 16) & 0xFFF;
-            entry->DIR_FstClusLO = newCluster & 0xFFFF;
-            entry->DIR_FileSize = 0;
-
-            ssize_t bytesWritten = pwrite(image->fd, entry, sizeof(directoryEntry), 
-				parentClusterOffset);
-	    if (bytesWritten != sizeof(directoryEntry)) {
-		return false;
-	    }
-		break;
-	}
-	parentClusterOffset += sizeof(directoryEntry);
+char *bufferCacheGet(uint32_t cluster, bool load) {
+    // Returns a pinned pointer to the cluster data, release it with bufferCacheRelease
+    // load is false when the caller overwrites the whole cluster
+    uint32_t clusterSize = bufferCacheClusterSize();
+    char *mapped = imageMap(convert_cluster_to_offset(cluster), clusterSize);
+    if (mapped != NULL) {
+        return mapped;
+    }
+    cacheBlock *block = lookupBufferCache(cluster);
+    if (block == NULL) {
+        bufferCacheMisses++;
+        block = newBufferCacheBlock(cluster);
+        if (block == NULL) {
+            return NULL;
+        }
+        if (load && imageRead(block->data, clusterSize, convert_cluster_to_offset(cluster)) != clusterSize) {
+            printf("Error: Failed to read cluster %" PRIu32 ".\n", cluster);
+            dropBufferCacheBlock(block);
+            return NULL;
+        }
+    } else {
+        bufferCacheHits++;
+        touchBufferCacheBlock(block);
     }
+    block->pins++;
+    return block->data;
+}
 
-    return true;
+void bufferCacheRelease(uint32_t cluster, bool dirty) {
+    // Unpins a block from bufferCacheGet, dirty blocks are written back on flush or eviction
+    cacheBlock *block = lookupBufferCache(cluster);
+    if (block == NULL) {
+        return;   // handed out straight from the mapped image
+    }
+    block->pins--;
+    if (dirty && !block->dirty) {
+        block->dirty = 1;
+        bufferCacheDirty++;
+    }
+    trimBufferCache();
 }
 
-bool createFile(const char *filename) {
-    int fat32_fd = image->fd;
-    uint32_t clusterSize = image->sectpClus * image->BpSect;
-    
-    for (int i = 0; i < numDirectoryEntries; i++) {
-        struct directoryEntry *dentry = &directoryEntries[i];
+bool bufferCacheFill(uint32_t firstCluster, uint32_t count) {
+    return bufferCacheFillRuns(&firstCluster, &count, 1);
+}
 
-        if (compareDirectoryEntryName(dentry->DIR_Name, filename) == 1) {
-            printf("Error: File already exists.\n");
-            return false;
+bool bufferCacheFillRuns(const uint32_t *firstClusters, const uint32_t *counts, int numRuns) {
+    // Loads the uncached clusters of several contiguous runs, each gap becomes one
+    // segment of a single batch read so a fragmented chain is not read cluster by cluster
+    uint32_t clusterSize = bufferCacheClusterSize();
+    // never read ahead of what the cache is allowed to hold
+    uint32_t maxBlocks = bufferCacheBudget / clusterSize;
+    uint32_t total = 0;
+    for (int r = 0; r < numRuns; r++) {
+        if (imageMap(convert_cluster_to_offset(firstClusters[r]), (size_t)counts[r] * clusterSize) == NULL) {
+            total += counts[r];
         }
     }
-    
-    //iterate through the cluster chain to find available entries
-    uint32_t clusterNumber = currentClusterNumber;
-    while (clusterNumber >= 2) {
-        uint32_t offset = image->dataStartOffset + (clusterNumber - 2) * clusterSize;
-        uint32_t end_offset = image->dataStartOffset + (clusterNumber - 2) * clusterSize + clusterSize;
-
-        //check if there is space in the current cluster
-        while (offset + sizeof(directoryEntry) <= end_offset) {
-            directoryEntry *entry = encode_dir_entry(fat32_fd, offset);
-
-            if (entry->DIR_Name[0] == 0x00 || entry->DIR_Name[0] == 0xE5) {
-                strncpy(entry->DIR_Name, filename, 11);
-                entry->DIR_Attr = ATTR_ARCHIVE;
-                entry->DIR_FstClusHI = (clusterNumber >> 16) & 0xFFF;
-                entry->DIR_FstClusLO = clusterNumber & 0xFFFF;
-                entry->DIR_FileSize = 0;
-
-                ssize_t bytesWritten = pwrite(image->fd, entry, sizeof(directoryEntry), offset);
-                return true;
+    if (total > maxBlocks) {
+        total = maxBlocks;
+    }
+    if (total == 0) {
+        return true;
+    }
+    struct iovec *iov = malloc(sizeof(struct iovec) * total);
+    cacheBlock **blocks = malloc(sizeof(cacheBlock *) * total);
+    ioSegment *segments = malloc(sizeof(ioSegment) * total);
+    if (iov == NULL || blocks == NULL || segments == NULL) {
+        free(iov);
+        free(blocks);
+        free(segments);
+        return false;
+    }
+    uint32_t n = 0;
+    int numSegments = 0;
+    for (int r = 0; r < numRuns && n < total; r++) {
+        uint32_t last = firstClusters[r] + counts[r];
+        if (imageMap(convert_cluster_to_offset(firstClusters[r]), (size_t)counts[r] * clusterSize) != NULL) {
+            continue;
+        }
+        for (uint32_t cluster = firstClusters[r]; cluster < last && n < total; cluster++) {
+            if (lookupBufferCache(cluster) != NULL) {
+                continue;
+            }
+            cacheBlock *block = newBufferCacheBlock(cluster);
+            if (block == NULL) {
+                break;
+            }
+            block->pins++;   // keep the gap alive until it is filled
+            // extend the current segment while the clusters stay adjacent
+            if (n == 0 || blocks[n - 1]->cluster + 1 != cluster) {
+                segments[numSegments].iov = &iov[n];
+                segments[numSegments].iovcnt = 0;
+                segments[numSegments].offset = convert_cluster_to_offset(cluster);
+                numSegments++;
             }
-            offset += sizeof(directoryEntry);
+            segments[numSegments - 1].iovcnt++;
+            blocks[n] = block;
+            iov[n].iov_base = block->data;
+            iov[n].iov_len = clusterSize;
+            n++;
         }
-
-        //get next cluster in the chain
-        clusterNumber = getNextCluster(clusterNumber);
     }
-	
-    //if no available space, allocate a new cluster and add the entry
-    uint32_t newCluster = allocateNewCluster();
+    bool ok = imageReadBatch(segments, numSegments);
+    if (ok) {
+        bufferCachePrefetched += n;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        blocks[i]->pins--;
+        if (!ok) {
+            dropBufferCacheBlock(blocks[i]);
+        }
+    }
+    free(iov);
+    free(blocks);
+    free(segments);
+    trimBufferCache();
+    return ok;
+}
 
-    if (newCluster == 0) {
-        printf("Error: No free clusters.\n");
-        return false;
+ssize_t bufferCacheTransfer(char *buf, size_t len, off_t offset, bool toCache) {
+    // Copies between buf and the cached clusters covering [offset, offset + len)
+    uint32_t clusterSize = bufferCacheClusterSize();
+    if (imageMap(offset, len) != NULL) {
+        return toCache ? imageWrite(buf, len, offset) : imageRead(buf, len, offset);
+    }
+    size_t done = 0;
+    while (done < len) {
+        off_t pos = offset + done;
+        uint32_t cluster = (pos - image->dataStartOffset) / clusterSize + 2;
+        size_t within = (pos - image->dataStartOffset) % clusterSize;
+        size_t n = (clusterSize - within < len - done) ? clusterSize - within : len - done;
+        if (!toCache && lookupBufferCache(cluster) == NULL) {
+            // pull in the rest of the request with vectored reads
+            uint32_t remaining = (within + len - done + clusterSize - 1) / clusterSize;
+            bufferCacheFill(cluster, remaining);
+        }
+        // a write covering the whole cluster does not need the old data
+        char *data = bufferCacheGet(cluster, !toCache || n != clusterSize);
+        if (data == NULL) {
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        if (toCache) {
+            memcpy(data + within, buf + done, n);
+        } else {
+            memcpy(buf + done, data + within, n);
+        }
+        bufferCacheRelease(cluster, toCache);
+        done += n;
     }
+    return done;
+}
 
-    loadDirectoryEntries(newCluster);
+ssize_t bufferCacheRead(void *buf, size_t len, off_t offset) {
+    return bufferCacheTransfer(buf, len, offset, false);
+}
 
-    for (int i = 0; i < numDirectoryEntries; i++) {
-        struct directoryEntry *dentry = &directoryEntries[i];
+ssize_t bufferCacheWrite(const void *buf, size_t len, off_t offset) {
+    return bufferCacheTransfer((char *)buf, len, offset, true);
+}
 
-        if (dentry->DIR_Name[0] == 0x00 || dentry->DIR_Name[0] == 0xE5) {
-            strncpy(dentry->DIR_Name, filename, 11);
-            dentry->DIR_Attr = ATTR_ARCHIVE;
-            dentry->DIR_FstClusHI = (newCluster >> 16) & 0xFFF;
-            dentry->DIR_FstClusLO = newCluster & 0xFFFF;
-            dentry->DIR_FileSize = 0;
+int compareCacheBlocks(const void *a, const void *b) {
+    uint32_t x = (*(cacheBlock *const *)a)->cluster;
+    uint32_t y = (*(cacheBlock *const *)b)->cluster;
+    return (x > y) - (x < y);
+}
 
-            uint32_t offset = convert_cluster_to_offset(newCluster) + (i * sizeof(directoryEntry));
-            ssize_t bytesWritten = pwrite(image->fd, dentry, sizeof(directoryEntry), offset);
+bool flushBufferCache() {
+    // Writes dirty blocks back in cluster order, adjacent clusters share one vectored write
+    if (bufferCacheDirty == 0) {
+        return true;
+    }
+    uint32_t clusterSize = bufferCacheClusterSize();
+    cacheBlock **dirty = malloc(sizeof(cacheBlock *) * bufferCacheDirty);
+    struct iovec *iov = malloc(sizeof(struct iovec) * bufferCacheDirty);
+    if (dirty == NULL || iov == NULL) {
+        free(dirty);
+        free(iov);
+        return false;
+    }
+    uint32_t numDirty = 0;
+    for (cacheBlock *block = bufferCacheHead; block != NULL; block = block->next) {
+        if (block->dirty) {
+            dirty[numDirty++] = block;
+        }
+    }
+    qsort(dirty, numDirty, sizeof(cacheBlock *), compareCacheBlocks);
 
-            return true;
+    bool ok = true;
+    uint32_t i = 0;
+    while (i < numDirty) {
+        uint32_t j = i;
+        do {
+            iov[j - i].iov_base = dirty[j]->data;
+            iov[j - i].iov_len = clusterSize;
+            j++;
+        } while (j < numDirty && dirty[j]->cluster == dirty[j - 1]->cluster + 1);
+        ssize_t expected = (ssize_t)(j - i) * clusterSize;
+        if (imageWritev(iov, j - i, convert_cluster_to_offset(dirty[i]->cluster)) != expected) {
+            printf("Error: Failed to write back cluster %" PRIu32 ".\n", dirty[i]->cluster);
+            ok = false;
+        } else {
+            for (uint32_t k = i; k < j; k++) {
+                dirty[k]->dirty = 0;
+                bufferCacheDirty--;
+            }
         }
+        i = j;
+    }
+    free(dirty);
+    free(iov);
+    return ok;
+}
+
+void freeBufferCache() {
+    // Drops every cached block, call flushBufferCache first to keep dirty data
+    while (bufferCacheHead != NULL) {
+        dropBufferCacheBlock(bufferCacheHead);
     }
+    bufferCacheDirty = 0;
+}
 
-    printf("Error: No free directory entries.\n");
-    return false;
+uint16_t readLE16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
 }
 
+uint32_t readLE32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool isPowerOfTwo(uint32_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
 
 //assumes file descriptor is set
-void initImage() {
-    char buf0[2];
-    ssize_t bytes_read0 = pread(image->fd, buf0, 2, 11);
-    image->BpSect = buf0[0] + buf0[1] << 8;
-
-    char buf1[1];
-    ssize_t bytes_read1 = pread(image->fd, buf1, 1, 13);
-    image->sectpClus = buf1[0];
-
-    char buf2[2];
-    ssize_t bytes_read2 = pread(image->fd, buf2, 2, 14);
-    image->rsvSecCnt = (buf2[1] << 8) | buf2[0];
-    int fatAddr = image->BpSect * image->rsvSecCnt;
-
-    char buf3[1];
-    ssize_t bytes_read3 = pread(image->fd, buf3, 1, 16);
-    image->numFATs = buf3[0];
-
-    char buf4[4];
-    ssize_t bytes_read4 = pread(image->fd, buf4, 4, 36);
-    image->secpFAT = (buf4[0] & 0xFF) + (buf4[1] << 8) + (buf4[2] << 16) + (buf4[3] << 24);
-
-    char buf5[4];
-    ssize_t bytes_read5 = pread(image->fd, buf5, 4, 44);
-    image->rootClus = buf5[0] + (buf5[1] << 8) + (buf5[2] << 16) + (buf5[3] << 24);
-
-    uint16_t totSec16;
-    uint32_t totSec32;
-    ssize_t bytes_read6 = pread(image->fd, &totSec16, 2, 19);
-    ssize_t bytes_read7 = pread(image->fd, &totSec32, 4, 32);
+bool initImage() {
+    // Parses and validates the BPB from one read of the boot sector
+    uint8_t boot[512];
+    if (imageRead(boot, sizeof(boot), 0) != sizeof(boot)) {
+        printf("Error: Failed to read the boot sector.\n");
+        return false;
+    }
+    if (boot[510] != 0x55 || boot[511] != 0xAA) {
+        printf("Error: Boot sector signature is missing.\n");
+        return false;
+    }
+    image->BpSect = readLE16(boot + 11);
+    image->sectpClus = boot[13];
+    image->rsvSecCnt = readLE16(boot + 14);
+    image->numFATs = boot[16];
+    uint16_t totSec16 = readLE16(boot + 19);
+    uint16_t fatSz16 = readLE16(boot + 22);
+    uint32_t totSec32 = readLE32(boot + 32);
+    image->secpFAT = readLE32(boot + 36);
+    image->rootClus = readLE32(boot + 44);
+    uint16_t fsInfoSec = readLE16(boot + 48);
+    uint16_t bkBootSec = readLE16(boot + 50);
     image->totalSec = totSec16 ? totSec16 : totSec32;
 
-    uint32_t totalDataSec = image->totalSec - (image->rsvSecCnt + (image->numFATs * image->secpFAT));
+    if (image->BpSect < 512 || image->BpSect > 4096 || !isPowerOfTwo(image->BpSect) ||
+        !isPowerOfTwo(image->sectpClus) || (uint32_t)image->BpSect * image->sectpClus > 64 * 1024) {
+        printf("Error: Invalid sector or cluster size.\n");
+        return false;
+    }
+    if (image->rsvSecCnt == 0 || image->numFATs == 0 || fatSz16 != 0 || image->secpFAT == 0) {
+        printf("Error: Not a FAT32 image.\n");
+        return false;
+    }
+    uint32_t metaSec = image->rsvSecCnt + image->numFATs * image->secpFAT;
+    if (image->totalSec <= metaSec || (int64_t)image->totalSec * image->BpSect > image->size) {
+        printf("Error: Sector count does not match the image size.\n");
+        return false;
+    }
+
+    uint32_t totalDataSec = image->totalSec - metaSec;
     image->totalDataClus = totalDataSec / image->sectpClus;
     uint32_t fatSizeInBytes = image->secpFAT * image->BpSect;
     image->entpFAT = fatSizeInBytes / 4;
-    
-    image->dataStartOffset = image->BpSect * (image->rsvSecCnt + image->secpFAT * image->numFATs);
+    image->maxClus = image->totalDataClus + 1;
+    if (image->maxClus >= image->entpFAT) {
+        image->maxClus = image->entpFAT - 1;
+    }
+    if (image->rootClus < 2 || image->rootClus > image->maxClus) {
+        printf("Error: Root cluster %" PRIu32 " is out of range.\n", image->rootClus);
+        return false;
+    }
+
+    // FSInfo sector, only trusted when both signatures match
+    image->fsInfoSec = 0;
+    uint8_t fsInfo[512];
+    if (fsInfoSec != 0 && fsInfoSec < image->rsvSecCnt &&
+        imageRead(fsInfo, sizeof(fsInfo), (off_t)fsInfoSec * image->BpSect) == sizeof(fsInfo) &&
+        readLE32(fsInfo) == FSI_LEAD_SIG && readLE32(fsInfo + 484) == FSI_STRUC_SIG) {
+        image->fsInfoSec = fsInfoSec;
+        // the free count is recounted while building the free cluster map
+        uint32_t nextFree = readLE32(fsInfo + 492);
+        if (nextFree != FSI_UNKNOWN) {
+            nextFreeHint = nextFree;
+        }
+        // the backup boot sector is followed by its own FSInfo copy, kept in step when valid
+        image->fsInfoBackupSec = 0;
+        uint32_t backupSec = (uint32_t)bkBootSec + fsInfoSec;
+        if (bkBootSec != 0 && bkBootSec != 0xFFFF && backupSec < image->rsvSecCnt &&
+            imageRead(fsInfo, sizeof(fsInfo), (off_t)backupSec * image->BpSect) == sizeof(fsInfo) &&
+            readLE32(fsInfo) == FSI_LEAD_SIG && readLE32(fsInfo + 484) == FSI_STRUC_SIG) {
+            image->fsInfoBackupSec = backupSec;
+        }
+    }
+
+    image->dataStartOffset = image->BpSect * metaSec;
+    currentClusterNumber = image->rootClus;
+    return true;
 }
 
 //info command
@@ -927,79 +4261,70 @@ void displayPrompt(char *imageFileName, char *currentDirectory) {
 	} 
     printf("%s/%s> ", imageFileName, currentDirectory);
 }
-char *get_input(void) {
-    // Gets user input from image command line
-    char *buffer = NULL;
-    int bufsize = 0;
-    char line[5];
-    while (fgets(line, 5, stdin) != NULL) {
-        int addby = 0;
-        char *newln = strchr(line, '\n');
-        if (newln != NULL)
-            addby = newln - line;
-        else
-            addby = 5 - 1;
-        buffer = (char *)realloc(buffer, bufsize + addby);
-        memcpy(&buffer[bufsize], line, addby);
-        bufsize += addby;
-        if (newln != NULL)
-            break;
+char *read_command_line(FILE *in) {
+    // Reads one line without its newline, NULL once the input is exhausted
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length = getline(&line, &capacity, in);
+    if (length < 0) {
+        free(line);
+        return NULL;
     }
-    buffer = (char *)realloc(buffer, bufsize + 1);
-    buffer[bufsize] = 0;
-    return buffer;
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+        line[--length] = '\0';
+    }
+    return line;
 }
 
 directoryEntry* find_file_in_directory(const char* filename) {
-    // Used to find a specific file within a directory
-    for (int i = 0; i < numDirectoryEntries; ++i) {
-	if (compareDirectoryEntryName(directoryEntries[i].DIR_Name, filename)) {
-	    return &directoryEntries[i];
-	}
+    // Used to find a specific file within the last loaded directory
+    int i = findEntryIndex(currentDirectoryNode, filename);
+    if (i < 0) {
+	return NULL;
     }
-    return NULL;
+    return &currentDirectoryNode->entries[i];
 }
 
 bool is_directory_empty(uint32_t directoryCluster) {
-    // Checks to find if a directory is entry and returns true or false
-    uint32_t offset = convert_cluster_to_offset(directoryCluster);
-    directoryEntry entry;
-    int entriesToCheck = image->BpSect * image->sectpClus / sizeof(directoryEntry);  // Calculate number of entries per cluster
-
-    lseek(image->fd, offset, SEEK_SET);
-    // loops through the directory entries in the cluster
-    for (int i = 0; i < entriesToCheck; i++) {
-        // Read the next directory entry
-        if(pread(image->fd, &entry, sizeof(directoryEntry), offset + i * sizeof(directoryEntry)) != sizeof(directoryEntry)) {
-            printf("Failed to read directory entry\n");
-            return false;
-	}
-        printf("Current directory entry being checked: %.11s\n", entry.DIR_Name);
-        // Check if the entry is empty
-        if (entry.DIR_Name[0] == 0x00) {
-            return true;
-        } else if (entry.DIR_Name[0] == 0xE5) {
-            printf("Entry marked deleted\n");
+    // Checks every cluster of a directory and returns true if only '.' and '..' are left
+    dirCacheNode *node = getDirectory(directoryCluster);
+    if (node == NULL) {
+        printf("Failed to read directory entry\n");
+        return false;
+    }
+    for (int i = 0; i < node->numEntries; i++) {
+        directoryEntry *entry = &node->entries[i];
+        if (!isIndexedEntry(entry) || entry->DIR_Attr == 0x0F
+            || memcmp(entry->DIR_Name, ".          ", 11) == 0 || memcmp(entry->DIR_Name, "..         ", 11) == 0) {
             continue;
-	} else if ( i<2 && (entry.DIR_Name[0] == '.')) {
-            printf("Entry marked . or ..\n");
-	    continue;
-	}
-	return false;
+        }
+        return false;
     }
-
     return true;
 }
 
 bool remove_empty_directory(uint32_t directoryCluster, char *path) {
     // Removes empty directory entries based on cluster and path
+    if (strcmp(path, ".") == 0 || strcmp(path, "..") == 0) {
+        printf("Error: Cannot remove '%s'.\n", path);
+        return false;
+    }
     uint32_t targetCluster = findClusterInDirectory(directoryCluster, path);
     if(targetCluster == 0) {
         printf("Error locating directory\n");
 	return false;
     }
+    // the current directory and the ones above it have to stay
+    bool inUse = targetCluster == currentClusterNumber || targetCluster == image->rootClus;
+    for (int i = 0; i <= pathIndex && !inUse; i++) {
+        inUse = clusterPath[i] == targetCluster;
+    }
+    if (inUse) {
+        printf("Error: Cannot remove '%s', it is the current directory or above it.\n", path);
+        return false;
+    }
     if(is_directory_empty(targetCluster)) {
-        removeFile(path);
+        return removeEntry(directoryCluster, path);
     } else {
         printf("Directory is not empty\n");
 	return false;
@@ -1007,18 +4332,19 @@ bool remove_empty_directory(uint32_t directoryCluster, char *path) {
     return true;
 }
 
-void print_open_files() {
+bool print_open_files() {
     // Prints the list of opened files
     if(numOpenedFiles == 0){
         printf("No files open.\n");
-	return;
+	return true;
     }
     for(int i = 0; i < numOpenedFiles; i++) {
-        printf("Index: %d\nName: %s\nMode: " PRIu8 "\nOffset: " PRIu32 "\nPath: %s\n", i, opened_files[i].name, opened_files[i].access_mode, opened_files[i].offset, opened_files[i].path);
+        printf("Index: %d\nName: %s\nMode: %" PRIu8 "\nOffset: %" PRIu32 "\nPath: /%s\n", i, opened_files[i].name, opened_files[i].access_mode, opened_files[i].offset, opened_files[i].path);
     }
+    return true;
 }
 
-void set_lseek(char* filename, int new_offset) {
+bool set_lseek(char* filename, int new_offset) {
     // Sets lseek function in the shell
     bool file = false;
     bool offset_val = false;
@@ -1028,14 +4354,24 @@ void set_lseek(char* filename, int new_offset) {
             file = true;
             if (opened_files[i].is_open) {
                 if (new_offset >= 0 && new_offset <= opened_files[i].size) {
+                    // a seek outside the buffered range ends the run of merged writes
+                    open_file *f = &opened_files[i];
+                    if (f->wb_len > 0 && (new_offset < f->wb_start || new_offset > f->wb_start + f->wb_len)
+                        && !flush_write_buffer(f)) {
+                        return false;
+                    }
                     opened_files[i].offset = new_offset;
+                    // a seek starts the read-ahead over
+                    opened_files[i].ra_next = new_offset;
+                    opened_files[i].ra_window = 0;
+                    opened_files[i].ra_end = 0;
                     offset_val = true;
                     printf("Offset set to %d for file '%s'\n", new_offset, filename);
                 }
                 break;
             } else {
                 printf("Error: File '%s' is not open.\n", filename);
-                return;
+                return false;
             }
         }
     }
@@ -1044,6 +4380,7 @@ void set_lseek(char* filename, int new_offset) {
     } else if (!offset_val) {
         printf("Error: Offset %d is out of bounds for file '%s'.\n", new_offset, filename);
     }
+    return file && offset_val;
 }
 
 tokenlist *new_tokenlist(void) {
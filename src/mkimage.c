@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+#include "fat32.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+// Writes synthetic FAT32 images for benchmarks and load tests:
+//   ./bin/mkimage [options] <image file>
+// The same options and seed always produce the same image.
+
+// fixed layout choices, the same ones mkfs.fat makes
+#define SECTOR_SIZE          512
+#define RESERVED_SECTORS     32
+#define NUM_FATS             2
+#define FSINFO_SECTOR        1
+#define BACKUP_BOOT_SECTOR   6
+#define MIN_FAT32_CLUSTERS   65525
+#define MAX_NAME_INDEX       10000000   // names are a letter and seven digits
+#define FILL_BUFFER_SIZE     (1024 * 1024)
+
+// file size distributions
+#define DIST_UNIFORM   0
+#define DIST_LOG       1
+
+typedef struct {
+    uint64_t sizeMB;
+    uint32_t clusterSize;
+    uint32_t fanout;          // subdirectories per directory
+    uint32_t depth;           // levels of subdirectories below the root
+    uint32_t filesPerDir;
+    uint32_t minFileSize;
+    uint32_t maxFileSize;
+    int sizeDist;
+    uint32_t fragmentation;   // percent chance a cluster does not follow the previous one
+    uint64_t seed;
+    bool fill;                // write a pattern into file clusters instead of leaving zeros
+} mkimageOptions;
+
+struct imageStruct geometry;
+mkimageOptions options;
+uint32_t *fat = NULL;
+uint32_t nextCluster = 2;
+uint64_t rngState;
+char *fillBuffer = NULL;
+
+// totals printed once the image is written
+uint64_t numDirs = 0;
+uint64_t numFiles = 0;
+uint64_t numFragmentedChains = 0;
+uint64_t fileBytes = 0;
+uint64_t usedClusters = 0;
+
+uint64_t nextRandom() {
+    // xorshift64*, so images do not depend on the libc rand()
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return rngState * 0x2545F4914F6CDD1DULL;
+}
+
+uint32_t randomBetween(uint32_t low, uint32_t high) {
+    if (high <= low) {
+        return low;
+    }
+    return low + (uint32_t)(nextRandom() % ((uint64_t)high - low + 1));
+}
+
+void putLE16(uint8_t *p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+void putLE32(uint8_t *p, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+off_t clusterOffset(uint32_t cluster) {
+    return geometry.dataStartOffset + (off_t)(cluster - 2) * geometry.BpSect * geometry.sectpClus;
+}
+
+bool writeAt(const void *buf, size_t len, off_t offset) {
+    // pwrite until everything is written
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(geometry.fd, (const char *)buf + done, len - done, offset + done);
+        if (n <= 0) {
+            perror("Error writing image");
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+bool computeGeometry() {
+    // Picks the FAT size so the FAT covers every data cluster that is left
+    geometry.BpSect = SECTOR_SIZE;
+    geometry.sectpClus = options.clusterSize / SECTOR_SIZE;
+    geometry.numFATs = NUM_FATS;
+    geometry.rsvSecCnt = RESERVED_SECTORS;
+    geometry.rootClus = 2;
+    geometry.fsInfoSec = FSINFO_SECTOR;
+    geometry.size = (int64_t)options.sizeMB * 1024 * 1024;
+    if (geometry.size / SECTOR_SIZE > UINT32_MAX) {
+        printf("Error: Images are limited to 2 TB.\n");
+        return false;
+    }
+    geometry.totalSec = geometry.size / SECTOR_SIZE;
+
+    uint32_t fatSectors = 1;
+    while (1) {
+        uint64_t metaSec = RESERVED_SECTORS + (uint64_t)NUM_FATS * fatSectors;
+        if (metaSec >= geometry.totalSec) {
+            printf("Error: Image is too small.\n");
+            return false;
+        }
+        uint32_t clusters = (geometry.totalSec - metaSec) / geometry.sectpClus;
+        uint32_t needed = ((uint64_t)clusters + 2) * 4 / SECTOR_SIZE + 1;
+        if (needed <= fatSectors) {
+            geometry.totalDataClus = clusters;
+            break;
+        }
+        fatSectors = needed;
+    }
+    geometry.secpFAT = fatSectors;
+    geometry.entpFAT = fatSectors * SECTOR_SIZE / 4;
+    geometry.maxClus = geometry.totalDataClus + 1;
+    geometry.dataStartOffset = SECTOR_SIZE * (RESERVED_SECTORS + NUM_FATS * fatSectors);
+    if (geometry.totalDataClus < MIN_FAT32_CLUSTERS) {
+        printf("Warning: %" PRIu32 " clusters is below the FAT32 minimum, other tools may not accept the image.\n",
+               geometry.totalDataClus);
+    }
+    return true;
+}
+
+uint32_t allocateChain(uint32_t count) {
+    // Links count clusters into a chain, skipping ahead to leave holes at the fragmentation rate
+    if (count == 0) {
+        return 0;
+    }
+    uint32_t first = 0, last = 0;
+    bool fragmented = false;
+    for (uint32_t i = 0; i < count; i++) {
+        if (i > 0 && randomBetween(1, 100) <= options.fragmentation) {
+            nextCluster += randomBetween(1, 16);
+            fragmented = true;
+        }
+        if (nextCluster > geometry.maxClus) {
+            printf("Error: Image is full, use a larger size or fewer files.\n");
+            exit(1);
+        }
+        uint32_t cluster = nextCluster++;
+        usedClusters++;
+        if (first == 0) {
+            first = cluster;
+        } else {
+            fat[last] = cluster;
+        }
+        last = cluster;
+    }
+    fat[last] = FAT_EOC;
+    if (fragmented) {
+        numFragmentedChains++;
+    }
+    return first;
+}
+
+bool writeChain(uint32_t first, const char *data, uint64_t len) {
+    // Writes data along a chain, one pwrite per run of contiguous clusters
+    uint32_t clusterSize = options.clusterSize;
+    uint32_t cluster = first;
+    uint64_t done = 0;
+    while (done < len) {
+        uint32_t runStart = cluster;
+        uint32_t runLength = 1;
+        while (fat[cluster] == cluster + 1 && (uint64_t)runLength * clusterSize < len - done) {
+            cluster = fat[cluster];
+            runLength++;
+        }
+        uint64_t n = (uint64_t)runLength * clusterSize;
+        if (n > len - done) {
+            n = len - done;
+        }
+        if (!writeAt(data + done, n, clusterOffset(runStart))) {
+            return false;
+        }
+        done += n;
+        cluster = fat[cluster];
+    }
+    return true;
+}
+
+bool fillChain(uint32_t first, uint64_t len) {
+    // Writes the pattern buffer over a file chain, one cluster at a time
+    uint32_t clusterSize = options.clusterSize;
+    for (uint32_t cluster = first; len > 0 && cluster < FAT_EOC_MIN; cluster = fat[cluster]) {
+        uint32_t n = (len < clusterSize) ? len : clusterSize;
+        if (!writeAt(fillBuffer + (cluster % (FILL_BUFFER_SIZE / clusterSize)) * clusterSize, n, clusterOffset(cluster))) {
+            return false;
+        }
+        len -= n;
+    }
+    return true;
+}
+
+uint32_t bitLength(uint32_t value) {
+    uint32_t bits = 0;
+    while (value != 0) {
+        bits++;
+        value >>= 1;
+    }
+    return bits;
+}
+
+uint32_t randomFileSize() {
+    if (options.sizeDist == DIST_LOG) {
+        // log-uniform: pick a power of two range first, then a size inside it
+        uint32_t bits = randomBetween(bitLength(options.minFileSize), bitLength(options.maxFileSize));
+        uint64_t low = bits > 0 ? 1ULL << (bits - 1) : 0;
+        uint64_t high = (1ULL << bits) - 1;
+        if (low < options.minFileSize) {
+            low = options.minFileSize;
+        }
+        if (high > options.maxFileSize) {
+            high = options.maxFileSize;
+        }
+        return randomBetween(low, high);
+    }
+    return randomBetween(options.minFileSize, options.maxFileSize);
+}
+
+void setEntry(directoryEntry *entry, const char *name, uint8_t attr, uint32_t cluster, uint32_t size) {
+    memset(entry, 0, sizeof(directoryEntry));
+    memset(entry->DIR_Name, ' ', 11);
+    memcpy(entry->DIR_Name, name, strlen(name));
+    entry->DIR_Attr = attr;
+    entry->DIR_FstClusHI = cluster >> 16;
+    entry->DIR_FstClusLO = cluster & 0xFFFF;
+    entry->DIR_FileSize = size;
+}
+
+bool buildDirectory(uint32_t cluster, uint32_t parentCluster, uint32_t level, uint32_t numEntries) {
+    // Fills an allocated directory chain with its files and subdirectories, recursing into them
+    uint32_t clusterSize = options.clusterSize;
+    uint32_t clusters = ((uint64_t)numEntries * sizeof(directoryEntry) + clusterSize - 1) / clusterSize;
+    if (clusters == 0) {
+        clusters = 1;
+    }
+    directoryEntry *entries = calloc(clusters, clusterSize);
+    if (entries == NULL) {
+        perror("Error allocating directory");
+        return false;
+    }
+    uint32_t n = 0;
+    if (cluster != geometry.rootClus) {
+        setEntry(&entries[n++], ".", ATTR_DIRECTORY, cluster, 0);
+        setEntry(&entries[n++], "..", ATTR_DIRECTORY, parentCluster == geometry.rootClus ? 0 : parentCluster, 0);
+    }
+    numDirs++;
+
+    char name[12];
+    for (uint32_t i = 0; i < options.filesPerDir; i++) {
+        uint32_t size = randomFileSize();
+        uint32_t first = allocateChain((size + clusterSize - 1) / clusterSize);
+        if (options.fill && !fillChain(first, size)) {
+            free(entries);
+            return false;
+        }
+        snprintf(name, sizeof(name), "F%07" PRIu32, i);
+        setEntry(&entries[n++], name, ATTR_ARCHIVE, first, size);
+        numFiles++;
+        fileBytes += size;
+    }
+
+    uint32_t subdirs = (level < options.depth) ? options.fanout : 0;
+    uint32_t childEntries = 2 + options.filesPerDir + ((level + 1 < options.depth) ? options.fanout : 0);
+    uint32_t childClusters = ((uint64_t)childEntries * sizeof(directoryEntry) + clusterSize - 1) / clusterSize;
+    for (uint32_t i = 0; i < subdirs; i++) {
+        uint32_t child = allocateChain(childClusters);
+        snprintf(name, sizeof(name), "D%07" PRIu32, i);
+        setEntry(&entries[n++], name, ATTR_DIRECTORY, child, 0);
+        if (!buildDirectory(child, cluster, level + 1, childEntries)) {
+            free(entries);
+            return false;
+        }
+    }
+
+    bool ok = writeChain(cluster, (const char *)entries, (uint64_t)clusters * clusterSize);
+    free(entries);
+    return ok;
+}
+
+bool writeBootSectors() {
+    // Boot sector and FSInfo, each also written to the backup copy
+    uint8_t boot[SECTOR_SIZE];
+    memset(boot, 0, sizeof(boot));
+    memcpy(boot, "\xEB\x58\x90" "MKIMAGE ", 11);
+    putLE16(boot + 11, geometry.BpSect);
+    boot[13] = geometry.sectpClus;
+    putLE16(boot + 14, geometry.rsvSecCnt);
+    boot[16] = geometry.numFATs;
+    boot[21] = 0xF8;                        // fixed media
+    putLE16(boot + 24, 63);                 // sectors per track
+    putLE16(boot + 26, 255);                // heads
+    putLE32(boot + 32, geometry.totalSec);
+    putLE32(boot + 36, geometry.secpFAT);
+    putLE32(boot + 44, geometry.rootClus);
+    putLE16(boot + 48, geometry.fsInfoSec);
+    putLE16(boot + 50, BACKUP_BOOT_SECTOR);
+    boot[64] = 0x80;                        // drive number
+    boot[66] = 0x29;                        // extended boot signature
+    putLE32(boot + 67, (uint32_t)options.seed);
+    memcpy(boot + 71, "NO NAME    FAT32   ", 19);
+    boot[510] = 0x55;
+    boot[511] = 0xAA;
+
+    uint8_t fsInfo[SECTOR_SIZE];
+    memset(fsInfo, 0, sizeof(fsInfo));
+    putLE32(fsInfo, FSI_LEAD_SIG);
+    putLE32(fsInfo + 484, FSI_STRUC_SIG);
+    uint32_t freeCount = 0;
+    for (uint32_t c = 2; c <= geometry.maxClus; c++) {
+        if (fat[c] == 0) {
+            freeCount++;
+        }
+    }
+    putLE32(fsInfo + 488, freeCount);
+    putLE32(fsInfo + 492, nextCluster <= geometry.maxClus ? nextCluster : FSI_UNKNOWN);
+    putLE32(fsInfo + 508, FSI_TRAIL_SIG);
+
+    return writeAt(boot, SECTOR_SIZE, 0) &&
+           writeAt(fsInfo, SECTOR_SIZE, (off_t)FSINFO_SECTOR * SECTOR_SIZE) &&
+           writeAt(boot, SECTOR_SIZE, (off_t)BACKUP_BOOT_SECTOR * SECTOR_SIZE) &&
+           writeAt(fsInfo, SECTOR_SIZE, (off_t)(BACKUP_BOOT_SECTOR + FSINFO_SECTOR) * SECTOR_SIZE);
+}
+
+bool writeFATs() {
+    // Every FAT copy is written with one pwrite
+    size_t fatBytes = (size_t)geometry.secpFAT * SECTOR_SIZE;
+    for (int i = 0; i < geometry.numFATs; i++) {
+        off_t offset = (off_t)(geometry.rsvSecCnt + i * geometry.secpFAT) * SECTOR_SIZE;
+        if (!writeAt(fat, fatBytes, offset)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool parseSizeRange(const char *arg) {
+    // <min>[:<max>] in bytes
+    char *end;
+    options.minFileSize = strtoul(arg, &end, 10);
+    options.maxFileSize = (*end == ':') ? strtoul(end + 1, NULL, 10) : options.minFileSize;
+    return options.maxFileSize >= options.minFileSize;
+}
+
+void printUsage() {
+    printf("Usage: ./mkimage [options] <image file>\n"
+           "  --size-mb <n>          image size (default 256)\n"
+           "  --cluster-size <n>     bytes per cluster, 512 to 32768 (default 4096)\n"
+           "  --fanout <n>           subdirectories per directory (default 4)\n"
+           "  --depth <n>            levels of subdirectories (default 2)\n"
+           "  --files <n>            files per directory (default 16)\n"
+           "  --file-size <min>[:<max>]  file size range in bytes (default 0:16384)\n"
+           "  --size-dist uniform|log    file size distribution (default uniform)\n"
+           "  --fragmentation <pct>  chance a cluster does not follow the previous one (default 0)\n"
+           "  --seed <n>             random seed (default 1)\n"
+           "  --fill                 write a pattern into file data instead of zeros\n");
+}
+
+int main(int argc, char *argv[]) {
+    char *imageFileName = NULL;
+    options = (mkimageOptions){ 256, 4096, 4, 2, 16, 0, 16384, DIST_UNIFORM, 0, 1, false };
+
+    // Parses options, the remaining argument is the image to write
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--size-mb") == 0 && hasValue) {
+            options.sizeMB = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--cluster-size") == 0 && hasValue) {
+            options.clusterSize = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--fanout") == 0 && hasValue) {
+            options.fanout = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--depth") == 0 && hasValue) {
+            options.depth = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--files") == 0 && hasValue) {
+            options.filesPerDir = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--file-size") == 0 && hasValue) {
+            if (!parseSizeRange(argv[++i])) {
+                imageFileName = NULL;
+                break;
+            }
+        } else if (strcmp(argv[i], "--size-dist") == 0 && hasValue) {
+            options.sizeDist = (strcmp(argv[++i], "log") == 0) ? DIST_LOG : DIST_UNIFORM;
+        } else if (strcmp(argv[i], "--fragmentation") == 0 && hasValue) {
+            options.fragmentation = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--seed") == 0 && hasValue) {
+            options.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--fill") == 0) {
+            options.fill = true;
+        } else if (imageFileName == NULL && argv[i][0] != '-') {
+            imageFileName = argv[i];
+        } else {
+            imageFileName = NULL;
+            break;
+        }
+    }
+    if (imageFileName == NULL) {
+        printUsage();
+        return 1;
+    }
+    if (options.clusterSize < SECTOR_SIZE || options.clusterSize > 32768 ||
+        (options.clusterSize & (options.clusterSize - 1)) != 0) {
+        printf("Error: Cluster size must be a power of two from 512 to 32768.\n");
+        return 1;
+    }
+    if (options.filesPerDir >= MAX_NAME_INDEX || options.fanout >= MAX_NAME_INDEX || options.fragmentation > 100) {
+        printf("Error: Files and fanout must be below %d and fragmentation at most 100.\n", MAX_NAME_INDEX);
+        return 1;
+    }
+    rngState = options.seed ? options.seed : 1;
+    if (!computeGeometry()) {
+        return 1;
+    }
+
+    geometry.fd = open(imageFileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (geometry.fd < 0) {
+        perror("Error opening image");
+        return 1;
+    }
+    // a sparse file of the final size, data nobody writes reads back as zeros
+    if (ftruncate(geometry.fd, geometry.size) != 0) {
+        perror("Error sizing image");
+        return 1;
+    }
+    fat = calloc(geometry.entpFAT, sizeof(uint32_t));
+    if (fat == NULL) {
+        perror("Error allocating FAT");
+        return 1;
+    }
+    fat[0] = 0x0FFFFFF8;   // media descriptor in the low byte
+    fat[1] = FAT_EOC;
+    if (options.fill) {
+        fillBuffer = malloc(FILL_BUFFER_SIZE);
+        for (int i = 0; i < FILL_BUFFER_SIZE; i++) {
+            fillBuffer[i] = 'A' + (nextRandom() % 26);
+        }
+    }
+
+    // root first, so it lands on cluster 2
+    uint32_t rootEntries = options.filesPerDir + (options.depth > 0 ? options.fanout : 0);
+    uint32_t rootClusters = ((uint64_t)rootEntries * sizeof(directoryEntry) + options.clusterSize - 1) / options.clusterSize;
+    nextCluster = geometry.rootClus;
+    allocateChain(rootClusters > 0 ? rootClusters : 1);
+    bool ok = buildDirectory(geometry.rootClus, 0, 0, rootEntries) && writeFATs() && writeBootSectors() &&
+              fsync(geometry.fd) == 0;
+    close(geometry.fd);
+    free(fat);
+    free(fillBuffer);
+    if (!ok) {
+        return 1;
+    }
+
+    printf("%s: %" PRIu64 " MB, %" PRIu32 " byte clusters, %" PRIu64 " directories, %" PRIu64 " files (%" PRIu64
+           " bytes), %" PRIu64 " clusters used, %" PRIu64 " fragmented chains\n",
+           imageFileName, options.sizeMB, options.clusterSize, numDirs, numFiles, fileBytes,
+           usedClusters, numFragmentedChains);
+    return 0;
+}